@@ -3,40 +3,643 @@
  * these tests in the EC 440 course taught by Orran Krieger. Contact both
  * professors before reusing this code elsewhere.
  */
+#define _GNU_SOURCE /* fallocate, O_DIRECT */
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#undef BLOCK_SIZE /* linux/fs.h has its own, disk.h defines ours */
+#define HAVE_URING 1
+#endif
+#endif
 
 #include "disk.h"
 
+#define VEC_MAX 1024 /* iovecs per preadv/pwritev (IOV_MAX on Linux) */
+#define DISK_MAGIC "EC440DSK" /* first bytes of an image with a header */
+#define QUEUE_DEPTH 64 /* outstanding block_submit requests */
+#define QUEUE_WORKERS 4 /* threads servicing the queue */
+#define POOL_MAX 64 /* aligned buffers disk_buf_put keeps for reuse, not a cap on live ones */
+#define URING_DEPTH 64 /* io_uring entries, also the disk_prep batch size */
+
+/* Geometry header in the first DISK_HDR_SIZE bytes of an image made by
+ * make_disk_geometry. Block 0 starts right after it. Images without the magic
+ * are old headerless ones with the default geometry.
+ */
+struct disk_header {
+	char magic[8];
+	uint32_t blocks;
+	uint32_t block_size;
+};
+
+/* One block_submit request: count adjacent blocks starting at block, moved
+ * to or from the contiguous buffer buf.
+ */
+struct disk_req {
+	int write;
+	int block;
+	int count;
+	void *buf;
+	disk_done_fn done;
+	void *arg;
+};
+
+/* One transfer in an io_uring batch, status is filled in on completion. */
+struct uring_op {
+	int write;
+	int block;
+	struct iovec *iov;
+	int cnt;
+	int status;
+};
+
+/* An open virtual disk. Everything here is fixed between disk_open and
+ * disk_close except for the queue, the pool and the counters, which carry
+ * their own synchronization.
+ */
+struct disk {
+	int handle; /* file handle to virtual disk */
+	int mode; /* DISK_* flags the disk was opened with, less fallbacks */
+	char *map; /* DISK_MMAP: the whole image mapped into memory */
+	size_t map_len; /* length of the mapping */
+	int nblocks; /* geometry of the disk */
+	int bsize;
+	off_t base; /* file offset of block 0 */
+
+	/* Bounded ring of requests serviced by a lazily started pool of
+	 * workers. pending counts requests that were submitted but haven't
+	 * completed yet.
+	 */
+	struct {
+		pthread_mutex_t lock;
+		pthread_cond_t not_empty;
+		pthread_cond_t not_full;
+		pthread_cond_t idle;
+		struct disk_req ring[QUEUE_DEPTH];
+		int head, len, pending;
+		int failed; /* a request failed since the last disk_drain */
+		int stop;
+		int nworkers;
+		pthread_t workers[QUEUE_WORKERS];
+	} queue;
+
+	/* Free list of DISK_ALIGN-aligned, one block buffers. */
+	struct {
+		pthread_mutex_t lock;
+		void *bufs[POOL_MAX];
+		int len;
+	} pool;
+
+	/* DISK_URING: the submission and completion rings shared with the
+	 * kernel. fd is -1 when there is no ring.
+	 */
+	struct {
+		int fd;
+		unsigned *sq_tail, *sq_mask, *sq_array;
+		unsigned *cq_head, *cq_tail, *cq_mask;
+		void *sqes, *cqes;
+		void *sq_ptr, *cq_ptr, *sqe_ptr;
+		size_t sq_len, cq_len, sqe_len;
+	} ring;
+
+	/* Requests staged by disk_prep for the next disk_flush. lock also
+	 * serializes use of the ring, which has a single submitter.
+	 */
+	struct {
+		pthread_mutex_t lock;
+		struct disk_req reqs[URING_DEPTH];
+		int len;
+		int failed; /* a request failed since the last disk_flush */
+	} batch;
+
+	/* Counters behind disk_stats, updated with atomics from any thread.
+	 * next is the block right after the previous request, used to tell
+	 * sequential requests from random ones.
+	 */
+	struct disk_stats stats;
+	long next;
+};
+
 /******************************************************************************/
-static int active = 0; /* is the virtual disk open (active) */
-static int handle; /* file handle to virtual disk       */
+static struct disk *active = NULL; /* disk behind the handle-less calls */
 /******************************************************************************/
 
+/* Handle-taking calls accept NULL for the disk opened with open_disk. */
+static struct disk *pick(struct disk *d, const char *who)
+{
+	if (!d)
+		d = active;
+	if (!d)
+		fprintf(stderr, "%s: disk not active\n", who);
+	return d;
+}
+
+/* Drop the first n bytes of an iovec after a short transfer. */
+static void block_skip(struct iovec **iov, int *cnt, size_t n)
+{
+	while (*cnt > 0 && n >= (*iov)->iov_len) {
+		n -= (*iov)->iov_len;
+		++*iov;
+		--*cnt;
+	}
+	if (*cnt > 0) {
+		(*iov)->iov_base = (char *)(*iov)->iov_base + n;
+		(*iov)->iov_len -= n;
+	}
+}
+
+/* Transfer iov to or from the image at byte offset off with positional
+ * preadv/pwritev, picking up again after a short transfer. Nothing here
+ * touches the file offset of handle, so any number of threads may have
+ * transfers in flight at once.
+ */
+static int block_xfer_at(struct disk *d, int write, off_t off,
+			 struct iovec *iov, int cnt)
+{
+	ssize_t n;
+
+	while (cnt > 0) {
+		if (write)
+			n = pwritev(d->handle, iov, cnt, off);
+		else
+			n = preadv(d->handle, iov, cnt, off);
+
+		if (n <= 0) {
+			if (n == 0)
+				fprintf(stderr, "%s: unexpected end of disk\n",
+					write ? "block_write" : "block_read");
+			else
+				perror(write ? "block_write: failed to write" :
+					       "block_read: failed to read");
+			return -1;
+		}
+
+		off += n;
+		block_skip(&iov, &cnt, n);
+	}
+
+	return 0;
+}
+
+/* Transfer one run of adjacent blocks starting at block. */
+static int block_xfer(struct disk *d, int write, int block, struct iovec *iov,
+		      int cnt)
+{
+	return block_xfer_at(d, write, d->base + (off_t)block * d->bsize, iov,
+			     cnt);
+}
+
+/* DISK_DIRECT transfers need buffers aligned to DISK_ALIGN. Move the blocks
+ * of an iovec that doesn't qualify one at a time through a pool buffer.
+ */
+static int block_bounce(struct disk *d, int write, int block,
+			struct iovec *iov, int cnt)
+{
+	struct iovec one;
+	char *b, *p;
+	size_t left;
+	int ret = 0;
+
+	if (!(b = disk_buf_get(d)))
+		return -1;
+
+	for (; cnt > 0 && !ret; ++iov, --cnt) {
+		p = iov->iov_base;
+		for (left = iov->iov_len; left >= (size_t)d->bsize && !ret;
+		     left -= d->bsize, p += d->bsize) {
+			one.iov_base = b;
+			one.iov_len = d->bsize;
+			if (write)
+				memcpy(b, p, d->bsize);
+			ret = block_xfer(d, write, block++, &one, 1);
+			if (!write && !ret)
+				memcpy(p, b, d->bsize);
+		}
+	}
+
+	disk_buf_put(d, b);
+
+	return ret;
+}
+
+/* Bucket of a latency in the log2 histograms: bucket i holds [2^i, 2^(i+1)) */
+static int stats_bucket(unsigned long ns)
+{
+	int i = 0;
+
+	while ((ns >>= 1) && (i < DISK_STATS_BUCKETS - 1))
+		++i;
+
+	return i;
+}
+
+static void stats_account(struct disk *d, int write, int block, int count,
+			  unsigned long ns)
+{
+	struct disk_stats *st = &d->stats;
+	unsigned long bytes = (unsigned long)count * d->bsize;
+	long prev = __atomic_exchange_n(&d->next, (long)block + count,
+					__ATOMIC_RELAXED);
+
+	if (prev == block)
+		__atomic_fetch_add(&st->sequential, 1, __ATOMIC_RELAXED);
+	else
+		__atomic_fetch_add(&st->random, 1, __ATOMIC_RELAXED);
+
+	if (write) {
+		__atomic_fetch_add(&st->writes, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&st->write_bytes, bytes, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&st->write_lat[stats_bucket(ns)], 1,
+				   __ATOMIC_RELAXED);
+	} else {
+		__atomic_fetch_add(&st->reads, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&st->read_bytes, bytes, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&st->read_lat[stats_bucket(ns)], 1,
+				   __ATOMIC_RELAXED);
+	}
+}
+
+#ifdef HAVE_URING
+/* Set up an io_uring of URING_DEPTH entries for d and map its rings. */
+static int uring_init(struct disk *d)
+{
+	struct io_uring_params p;
+	int fd;
+
+	memset(&p, 0, sizeof(p));
+	if ((fd = syscall(__NR_io_uring_setup, URING_DEPTH, &p)) < 0)
+		return -1;
+
+	d->ring.sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	d->ring.cq_len = p.cq_off.cqes +
+			 p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (d->ring.cq_len > d->ring.sq_len)
+			d->ring.sq_len = d->ring.cq_len;
+		d->ring.cq_len = 0;
+	}
+	d->ring.sqe_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	d->ring.sq_ptr = mmap(NULL, d->ring.sq_len, PROT_READ | PROT_WRITE,
+			      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (d->ring.sq_ptr == MAP_FAILED)
+		goto fail_sq;
+
+	d->ring.cq_ptr = d->ring.sq_ptr;
+	if (d->ring.cq_len) {
+		d->ring.cq_ptr = mmap(NULL, d->ring.cq_len,
+				      PROT_READ | PROT_WRITE,
+				      MAP_SHARED | MAP_POPULATE, fd,
+				      IORING_OFF_CQ_RING);
+		if (d->ring.cq_ptr == MAP_FAILED)
+			goto fail_cq;
+	}
+
+	d->ring.sqe_ptr = mmap(NULL, d->ring.sqe_len, PROT_READ | PROT_WRITE,
+			       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (d->ring.sqe_ptr == MAP_FAILED)
+		goto fail_sqe;
+
+	d->ring.sq_tail = (unsigned *)((char *)d->ring.sq_ptr + p.sq_off.tail);
+	d->ring.sq_mask =
+		(unsigned *)((char *)d->ring.sq_ptr + p.sq_off.ring_mask);
+	d->ring.sq_array =
+		(unsigned *)((char *)d->ring.sq_ptr + p.sq_off.array);
+	d->ring.cq_head = (unsigned *)((char *)d->ring.cq_ptr + p.cq_off.head);
+	d->ring.cq_tail = (unsigned *)((char *)d->ring.cq_ptr + p.cq_off.tail);
+	d->ring.cq_mask =
+		(unsigned *)((char *)d->ring.cq_ptr + p.cq_off.ring_mask);
+	d->ring.cqes = (char *)d->ring.cq_ptr + p.cq_off.cqes;
+	d->ring.sqes = d->ring.sqe_ptr;
+	d->ring.fd = fd;
+
+	return 0;
+
+fail_sqe:
+	if (d->ring.cq_len)
+		munmap(d->ring.cq_ptr, d->ring.cq_len);
+fail_cq:
+	munmap(d->ring.sq_ptr, d->ring.sq_len);
+fail_sq:
+	close(fd);
+	return -1;
+}
+
+static void uring_exit(struct disk *d)
+{
+	if (d->ring.fd < 0)
+		return;
+
+	munmap(d->ring.sqe_ptr, d->ring.sqe_len);
+	if (d->ring.cq_len)
+		munmap(d->ring.cq_ptr, d->ring.cq_len);
+	munmap(d->ring.sq_ptr, d->ring.sq_len);
+	close(d->ring.fd);
+	d->ring.fd = -1;
+}
+
+/* Queue a readv/writev for op number i of a batch. Nothing reaches the
+ * kernel until uring_wait.
+ */
+static void uring_push(struct disk *d, struct uring_op *op, int i)
+{
+	unsigned tail = *d->ring.sq_tail;
+	unsigned idx = tail & *d->ring.sq_mask;
+	struct io_uring_sqe *sqe = (struct io_uring_sqe *)d->ring.sqes + idx;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op->write ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = d->handle;
+	sqe->off = d->base + (off_t)op->block * d->bsize;
+	sqe->addr = (uintptr_t)op->iov;
+	sqe->len = op->cnt;
+	sqe->user_data = i;
+	d->ring.sq_array[idx] = idx;
+
+	__atomic_store_n(d->ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Submit the n pushed ops with as few io_uring_enter calls as the kernel
+ * allows and reap their completions into res.
+ */
+static int uring_wait(struct disk *d, int n, int *res)
+{
+	struct io_uring_cqe *cqe;
+	unsigned head;
+	int ret, submitted = 0, done = 0;
+
+	while (done < n) {
+		ret = syscall(__NR_io_uring_enter, d->ring.fd, n - submitted,
+			      n - done, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("block_io: io_uring_enter failed");
+			return -1;
+		}
+		submitted += ret;
+
+		head = *d->ring.cq_head;
+		while (head != __atomic_load_n(d->ring.cq_tail,
+					       __ATOMIC_ACQUIRE)) {
+			cqe = (struct io_uring_cqe *)d->ring.cqes +
+			      (head & *d->ring.cq_mask);
+			res[cqe->user_data] = cqe->res;
+			++head;
+			++done;
+		}
+		__atomic_store_n(d->ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	return 0;
+}
+#else
+static int uring_init(struct disk *d)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+static void uring_exit(struct disk *d)
+{
+}
+
+static void uring_push(struct disk *d, struct uring_op *op, int i)
+{
+}
+
+static int uring_wait(struct disk *d, int n, int *res)
+{
+	return -1;
+}
+#endif
+
+/* Run a batch of at most URING_DEPTH ops through the ring with one
+ * submission, finishing short transfers with positional I/O. Must hold
+ * batch.lock with a ring set up. A ring that fails as a whole is torn down
+ * and the disk goes on without it.
+ */
+static int uring_run(struct disk *d, struct uring_op *ops, int n)
+{
+	int res[URING_DEPTH];
+	size_t len;
+	int i, j, ret = 0;
+
+	for (i = 0; i < n; ++i)
+		uring_push(d, &ops[i], i);
+
+	if (uring_wait(d, n, res) < 0) {
+		fprintf(stderr, "block_io: io_uring failed, "
+				"using positional I/O\n");
+		uring_exit(d);
+		for (i = 0; i < n; ++i)
+			res[i] = 0;
+	}
+
+	for (i = 0; i < n; ++i) {
+		for (len = 0, j = 0; j < ops[i].cnt; ++j)
+			len += ops[i].iov[j].iov_len;
+
+		if (res[i] < 0) {
+			errno = -res[i];
+			perror(ops[i].write ? "block_write: failed to write" :
+					      "block_read: failed to read");
+			ops[i].status = -1;
+			ret = -1;
+		} else if ((size_t)res[i] < len) {
+			/* a short transfer, pick it up at the byte where the
+			 * ring left off, which need not be a block boundary */
+			block_skip(&ops[i].iov, &ops[i].cnt, res[i]);
+			ops[i].status =
+				block_xfer_at(d, ops[i].write,
+					      d->base +
+					      (off_t)ops[i].block * d->bsize +
+					      res[i],
+					      ops[i].iov, ops[i].cnt);
+			ret |= ops[i].status;
+		} else {
+			ops[i].status = 0;
+		}
+		ops[i].cnt = len / d->bsize; /* blocks, for the accounting */
+	}
+
+	return ret;
+}
+
+/* uring_run for the batching callers: a batch is timed as a whole, every op
+ * in it counts as a request that took that long.
+ */
+static int uring_io(struct disk *d, struct uring_op *ops, int n)
+{
+	struct timespec t0, t1;
+	unsigned long ns;
+	int i, ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	ret = uring_run(d, ops, n);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	ns = (t1.tv_sec - t0.tv_sec) * 1000000000UL + t1.tv_nsec - t0.tv_nsec;
+	for (i = 0; i < n; ++i)
+		stats_account(d, ops[i].write, ops[i].block, ops[i].cnt, ns);
+
+	return ret;
+}
+
+static int block_aligned(const struct iovec *iov, int cnt)
+{
+	int i;
+
+	for (i = 0; i < cnt; ++i) {
+		if ((uintptr_t)iov[i].iov_base % DISK_ALIGN)
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Transfer a run of adjacent blocks: through the ring if it is free, else
+ * with positional I/O, bouncing it if O_DIRECT can't take the caller's
+ * buffers as they are.
+ */
+static int block_run(struct disk *d, int write, int block, struct iovec *iov,
+		     int cnt)
+{
+	struct uring_op op;
+	int ret;
+
+	if ((d->mode & DISK_DIRECT) && !block_aligned(iov, cnt))
+		return block_bounce(d, write, block, iov, cnt);
+
+	/* never wait for the ring, another thread's batch may be long */
+	if ((d->mode & DISK_URING) &&
+	    (pthread_mutex_trylock(&d->batch.lock) == 0)) {
+		if (d->ring.fd >= 0) {
+			op.write = write;
+			op.block = block;
+			op.iov = iov;
+			op.cnt = cnt;
+			ret = uring_run(d, &op, 1);
+			pthread_mutex_unlock(&d->batch.lock);
+			return ret;
+		}
+		pthread_mutex_unlock(&d->batch.lock);
+	}
+
+	return block_xfer(d, write, block, iov, cnt);
+}
+
+/* Every single transfer ends up here: move a run of adjacent blocks between
+ * the disk and iov, through the mapping, the ring or with positional I/O,
+ * and account for it as one request. Batches go through uring_io.
+ */
+static int block_io(struct disk *d, int write, int block, struct iovec *iov,
+		    int cnt)
+{
+	struct timespec t0, t1;
+	size_t len = 0;
+	char *p;
+	int i, ret = 0;
+
+	for (i = 0; i < cnt; ++i)
+		len += iov[i].iov_len;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	if (d->map) {
+		p = d->map + (size_t)block * d->bsize;
+		for (i = 0; i < cnt; p += iov[i].iov_len, ++i) {
+			if (write)
+				memcpy(p, iov[i].iov_base, iov[i].iov_len);
+			else
+				memcpy(iov[i].iov_base, p, iov[i].iov_len);
+		}
+	} else {
+		ret = block_run(d, write, block, iov, cnt);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	stats_account(d, write, block, len / d->bsize,
+		      (t1.tv_sec - t0.tv_sec) * 1000000000UL +
+			      t1.tv_nsec - t0.tv_nsec);
+
+	return ret;
+}
+
 int make_disk(const char *name)
 {
-	int f, cnt;
-	char buf[BLOCK_SIZE];
+	return make_disk_geometry(name, DISK_BLOCKS, BLOCK_SIZE, 0);
+}
+
+int make_disk_flags(const char *name, int flags)
+{
+	return make_disk_geometry(name, DISK_BLOCKS, BLOCK_SIZE, flags);
+}
+
+int make_disk_geometry(const char *name, int blocks, int block_size, int flags)
+{
+	int f;
+	off_t size;
+	char hdr[DISK_HDR_SIZE];
+	struct disk_header *h = (struct disk_header *)hdr;
 
 	if (!name) {
 		fprintf(stderr, "make_disk: invalid file name\n");
 		return -1;
 	}
 
+	if ((blocks <= 0) || (block_size < 512) ||
+	    (block_size & (block_size - 1))) {
+		fprintf(stderr, "make_disk: invalid disk geometry\n");
+		return -1;
+	}
+	size = DISK_HDR_SIZE + (off_t)blocks * block_size;
+
 	if ((f = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
 		perror("make_disk: cannot open file");
 		return -1;
 	}
 
-	memset(buf, 0, BLOCK_SIZE);
-	for (cnt = 0; cnt < DISK_BLOCKS; ++cnt) {
-		if (write(f, buf, BLOCK_SIZE) < 0) {
-			perror("make_disk: failed to write");
+	/* Unwritten blocks read back as zeroes either way: a sparse file
+	 * leaves them as holes, DISK_PREALLOC reserves them up front without
+	 * writing any data.
+	 */
+	if (flags & DISK_PREALLOC) {
+		if ((fallocate(f, 0, 0, size) < 0) && (errno != EOPNOTSUPP)) {
+			perror("make_disk: failed to fallocate");
+			close(f);
 			return -1;
 		}
+		/* EOPNOTSUPP: the host file system can't preallocate, go
+		 * sparse */
+	}
+
+	if (ftruncate(f, size) < 0) {
+		perror("make_disk: failed to size disk");
+		close(f);
+		return -1;
+	}
+
+	memset(hdr, 0, DISK_HDR_SIZE);
+	memcpy(h->magic, DISK_MAGIC, sizeof(h->magic));
+	h->blocks = blocks;
+	h->block_size = block_size;
+	if (pwrite(f, hdr, DISK_HDR_SIZE, 0) != DISK_HDR_SIZE) {
+		perror("make_disk: failed to write header");
+		close(f);
+		return -1;
 	}
 
 	close(f);
@@ -44,10 +647,136 @@ int make_disk(const char *name)
 	return 0;
 }
 
+struct disk *disk_open(const char *name, int flags)
+{
+	int f, fd;
+	struct stat st;
+	struct disk_header h;
+	struct disk *d;
+	void *m;
+
+	if (!name) {
+		fprintf(stderr, "open_disk: invalid file name\n");
+		return NULL;
+	}
+
+	if ((f = open(name, O_RDWR, 0644)) < 0) {
+		perror("open_disk: cannot open file");
+		return NULL;
+	}
+
+	if (fstat(f, &st) < 0) {
+		perror("open_disk: cannot stat file");
+		close(f);
+		return NULL;
+	}
+
+	memset(&h, 0, sizeof(h));
+	if (pread(f, &h, sizeof(h), 0) < 0) {
+		perror("open_disk: cannot read header");
+		close(f);
+		return NULL;
+	}
+
+	if (!(d = calloc(1, sizeof(*d)))) {
+		fprintf(stderr, "open_disk: out of memory\n");
+		close(f);
+		return NULL;
+	}
+
+	if (memcmp(h.magic, DISK_MAGIC, sizeof(h.magic)) == 0) {
+		d->nblocks = h.blocks;
+		d->bsize = h.block_size;
+		d->base = DISK_HDR_SIZE;
+	} else {
+		d->nblocks = DISK_BLOCKS;
+		d->bsize = BLOCK_SIZE;
+		d->base = 0;
+	}
+
+	if (st.st_size < d->base + (off_t)d->nblocks * d->bsize) {
+		fprintf(stderr, "open_disk: disk image is too small\n");
+		goto fail;
+	}
+
+	/* the header is read through the buffered descriptor above, O_DIRECT
+	 * only takes aligned transfers */
+	if (flags & DISK_DIRECT) {
+		if (flags & DISK_MMAP) {
+			fprintf(stderr,
+				"open_disk: DISK_MMAP and DISK_DIRECT don't mix\n");
+			goto fail;
+		}
+
+		if ((fd = open(name, O_RDWR | O_DIRECT)) >= 0) {
+			close(f);
+			f = fd;
+		} else if (errno == EINVAL) {
+			fprintf(stderr, "open_disk: O_DIRECT not supported, "
+					"using the page cache\n");
+			flags &= ~DISK_DIRECT;
+		} else {
+			perror("open_disk: cannot open file for direct I/O");
+			goto fail;
+		}
+	}
+
+	if (flags & DISK_MMAP) {
+		d->map_len = d->base + (size_t)d->nblocks * d->bsize;
+		m = mmap(NULL, d->map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+			 f, 0);
+		if (m == MAP_FAILED) {
+			perror("open_disk: cannot map file");
+			goto fail;
+		}
+		d->map = (char *)m + d->base;
+	}
+
+	d->handle = f;
+	d->ring.fd = -1;
+	if (flags & DISK_URING) {
+		if (flags & DISK_MMAP) {
+			fprintf(stderr,
+				"open_disk: DISK_MMAP and DISK_URING don't mix\n");
+			goto fail_map;
+		}
+
+		if (uring_init(d) < 0) {
+			fprintf(stderr, "open_disk: io_uring not available (%s), "
+					"using positional I/O\n",
+				strerror(errno));
+			flags &= ~DISK_URING;
+		}
+	}
+
+	pthread_mutex_init(&d->queue.lock, NULL);
+	pthread_cond_init(&d->queue.not_empty, NULL);
+	pthread_cond_init(&d->queue.not_full, NULL);
+	pthread_cond_init(&d->queue.idle, NULL);
+	pthread_mutex_init(&d->pool.lock, NULL);
+	pthread_mutex_init(&d->batch.lock, NULL);
+
+	d->mode = flags;
+	d->next = -1;
+
+	return d;
+
+fail_map:
+	if (d->map)
+		munmap(d->map - d->base, d->map_len);
+fail:
+	close(f);
+	free(d);
+	return NULL;
+}
+
 int open_disk(const char *name)
 {
-	int f;
+	return open_disk_flags(name, 0);
+}
 
+int open_disk_flags(const char *name, int flags)
+{
 	if (!name) {
 		fprintf(stderr, "open_disk: invalid file name\n");
 		return -1;
@@ -58,77 +787,635 @@ int open_disk(const char *name)
 		return -1;
 	}
 
-	if ((f = open(name, O_RDWR, 0644)) < 0) {
-		perror("open_disk: cannot open file");
+	if (!(active = disk_open(name, flags)))
 		return -1;
+
+	return 0;
+}
+
+/* Carry out one queued request with positional I/O. */
+static int queue_run(struct disk *d, struct disk_req *r)
+{
+	struct iovec iov;
+
+	iov.iov_base = r->buf;
+	iov.iov_len = (size_t)r->count * d->bsize;
+
+	return block_io(d, r->write, r->block, &iov, 1);
+}
+
+static void *queue_worker(void *arg)
+{
+	struct disk *d = arg;
+	struct disk_req r;
+	int status;
+
+	pthread_mutex_lock(&d->queue.lock);
+	for (;;) {
+		while (!d->queue.len && !d->queue.stop)
+			pthread_cond_wait(&d->queue.not_empty, &d->queue.lock);
+		if (!d->queue.len)
+			break;
+
+		r = d->queue.ring[d->queue.head];
+		d->queue.head = (d->queue.head + 1) % QUEUE_DEPTH;
+		--d->queue.len;
+		pthread_cond_signal(&d->queue.not_full);
+		pthread_mutex_unlock(&d->queue.lock);
+
+		status = queue_run(d, &r);
+		if (r.done)
+			r.done(r.arg, status);
+
+		pthread_mutex_lock(&d->queue.lock);
+		if (status < 0)
+			d->queue.failed = 1;
+		if (--d->queue.pending == 0)
+			pthread_cond_broadcast(&d->queue.idle);
 	}
+	pthread_mutex_unlock(&d->queue.lock);
 
-	handle = f;
-	active = 1;
+	return NULL;
+}
+
+int disk_submit(struct disk *d, int write, int block, int count, void *buf,
+		disk_done_fn done, void *arg)
+{
+	int tail;
+
+	if (!(d = pick(d, "block_submit")))
+		return -1;
+
+	if ((count <= 0) || (block < 0) || (block > d->nblocks - count)) {
+		fprintf(stderr, "block_submit: block index out of bounds\n");
+		return -1;
+	}
+
+	pthread_mutex_lock(&d->queue.lock);
+
+	/* start the pool on first use, synchronous users never pay for it */
+	while (d->queue.nworkers < QUEUE_WORKERS) {
+		if (pthread_create(&d->queue.workers[d->queue.nworkers], NULL,
+				   queue_worker, d) != 0) {
+			if (d->queue.nworkers)
+				break;
+			pthread_mutex_unlock(&d->queue.lock);
+			fprintf(stderr, "block_submit: cannot start workers\n");
+			return -1;
+		}
+		++d->queue.nworkers;
+	}
+
+	while (d->queue.len == QUEUE_DEPTH)
+		pthread_cond_wait(&d->queue.not_full, &d->queue.lock);
+
+	tail = (d->queue.head + d->queue.len) % QUEUE_DEPTH;
+	d->queue.ring[tail].write = write;
+	d->queue.ring[tail].block = block;
+	d->queue.ring[tail].count = count;
+	d->queue.ring[tail].buf = buf;
+	d->queue.ring[tail].done = done;
+	d->queue.ring[tail].arg = arg;
+	++d->queue.len;
+	++d->queue.pending;
+	pthread_cond_signal(&d->queue.not_empty);
+
+	pthread_mutex_unlock(&d->queue.lock);
 
 	return 0;
 }
 
-int close_disk()
+int block_submit(int write, int block, int count, void *buf,
+		 disk_done_fn done, void *arg)
 {
-	if (!active) {
-		fprintf(stderr, "close_disk: no open disk\n");
+	return disk_submit(NULL, write, block, count, buf, done, arg);
+}
+
+int disk_poll(struct disk *d)
+{
+	int pending;
+
+	if (!(d = pick(d, "disk_poll")))
+		return -1;
+
+	pthread_mutex_lock(&d->queue.lock);
+	pending = d->queue.pending;
+	pthread_mutex_unlock(&d->queue.lock);
+
+	return pending;
+}
+
+int disk_drain(struct disk *d)
+{
+	int ret;
+
+	if (!(d = pick(d, "disk_drain")))
+		return -1;
+
+	pthread_mutex_lock(&d->queue.lock);
+	while (d->queue.pending)
+		pthread_cond_wait(&d->queue.idle, &d->queue.lock);
+	ret = d->queue.failed ? -1 : 0;
+	d->queue.failed = 0;
+	pthread_mutex_unlock(&d->queue.lock);
+
+	return ret;
+}
+
+/* Carry out everything staged by disk_prep, the requests the ring can take
+ * in one submission and the rest one by one. Must hold batch.lock.
+ */
+static void batch_run(struct disk *d)
+{
+	struct uring_op ops[URING_DEPTH];
+	struct iovec iov[URING_DEPTH];
+	int idx[URING_DEPTH], status[URING_DEPTH];
+	struct disk_req *r;
+	int i, n = 0;
+
+	for (i = 0; i < d->batch.len; ++i) {
+		r = &d->batch.reqs[i];
+		iov[i].iov_base = r->buf;
+		iov[i].iov_len = (size_t)r->count * d->bsize;
+
+		if ((d->ring.fd >= 0) &&
+		    (!(d->mode & DISK_DIRECT) || block_aligned(&iov[i], 1))) {
+			ops[n].write = r->write;
+			ops[n].block = r->block;
+			ops[n].iov = &iov[i];
+			ops[n].cnt = 1;
+			idx[n++] = i;
+		} else {
+			status[i] = block_io(d, r->write, r->block, &iov[i], 1);
+		}
+	}
+
+	if (n) {
+		uring_io(d, ops, n);
+		for (i = 0; i < n; ++i)
+			status[idx[i]] = ops[i].status;
+	}
+
+	for (i = 0; i < d->batch.len; ++i) {
+		r = &d->batch.reqs[i];
+		if (status[i] < 0)
+			d->batch.failed = 1;
+		if (r->done)
+			r->done(r->arg, status[i]);
+	}
+	d->batch.len = 0;
+}
+
+int disk_prep(struct disk *d, int write, int block, int count, void *buf,
+	      disk_done_fn done, void *arg)
+{
+	struct disk_req *r;
+
+	if (!(d = pick(d, "block_prep")))
+		return -1;
+
+	if ((count <= 0) || (block < 0) || (block > d->nblocks - count)) {
+		fprintf(stderr, "block_prep: block index out of bounds\n");
 		return -1;
 	}
 
-	close(handle);
+	pthread_mutex_lock(&d->batch.lock);
+
+	if (d->batch.len == URING_DEPTH)
+		batch_run(d);
+
+	r = &d->batch.reqs[d->batch.len++];
+	r->write = write;
+	r->block = block;
+	r->count = count;
+	r->buf = buf;
+	r->done = done;
+	r->arg = arg;
 
-	active = handle = 0;
+	pthread_mutex_unlock(&d->batch.lock);
 
 	return 0;
 }
 
-int block_write(int block, const void *buf)
+int block_prep(int write, int block, int count, void *buf, disk_done_fn done,
+	       void *arg)
+{
+	return disk_prep(NULL, write, block, count, buf, done, arg);
+}
+
+int disk_flush(struct disk *d)
+{
+	int ret;
+
+	if (!(d = pick(d, "disk_flush")))
+		return -1;
+
+	pthread_mutex_lock(&d->batch.lock);
+	if (d->batch.len)
+		batch_run(d);
+	ret = d->batch.failed ? -1 : 0;
+	d->batch.failed = 0;
+	pthread_mutex_unlock(&d->batch.lock);
+
+	return ret;
+}
+
+int block_flush()
+{
+	return disk_flush(NULL);
+}
+
+/* Let outstanding requests finish and shut the worker pool down. */
+static int queue_stop(struct disk *d)
+{
+	int i, ret = disk_drain(d);
+
+	pthread_mutex_lock(&d->queue.lock);
+	d->queue.stop = 1;
+	pthread_cond_broadcast(&d->queue.not_empty);
+	pthread_mutex_unlock(&d->queue.lock);
+
+	for (i = 0; i < d->queue.nworkers; ++i)
+		pthread_join(d->queue.workers[i], NULL);
+
+	d->queue.nworkers = 0;
+	d->queue.stop = 0;
+
+	return ret;
+}
+
+int disk_close(struct disk *d)
+{
+	int ret = 0;
+
+	if (!d) {
+		fprintf(stderr, "close_disk: no open disk\n");
+		return -1;
+	}
+
+	if (queue_stop(d) < 0) {
+		fprintf(stderr, "close_disk: queued block I/O failed\n");
+		ret = -1;
+	}
+
+	if (disk_flush(d) < 0) {
+		fprintf(stderr, "close_disk: staged block I/O failed\n");
+		ret = -1;
+	}
+	uring_exit(d);
+
+	if (d->map) {
+		if (msync(d->map - d->base, d->map_len, MS_SYNC) < 0) {
+			perror("close_disk: failed to msync");
+			ret = -1;
+		}
+		munmap(d->map - d->base, d->map_len);
+	}
+
+	close(d->handle);
+	disk_buf_flush(d);
+
+	if (d->mode & DISK_STATS)
+		disk_stats_dump(d);
+
+	pthread_mutex_destroy(&d->queue.lock);
+	pthread_cond_destroy(&d->queue.not_empty);
+	pthread_cond_destroy(&d->queue.not_full);
+	pthread_cond_destroy(&d->queue.idle);
+	pthread_mutex_destroy(&d->pool.lock);
+	pthread_mutex_destroy(&d->batch.lock);
+	free(d);
+
+	return ret;
+}
+
+int close_disk()
 {
+	int ret;
+
 	if (!active) {
-		fprintf(stderr, "block_write: disk not active\n");
+		fprintf(stderr, "close_disk: no open disk\n");
 		return -1;
 	}
 
-	if ((block < 0) || (block >= DISK_BLOCKS)) {
+	ret = disk_close(active);
+	active = NULL;
+
+	return ret;
+}
+
+void *disk_buf_get(struct disk *d)
+{
+	void *buf = NULL;
+
+	if (!(d = pick(d, "disk_buf_get")))
+		return NULL;
+
+	pthread_mutex_lock(&d->pool.lock);
+	if (d->pool.len)
+		buf = d->pool.bufs[--d->pool.len];
+	pthread_mutex_unlock(&d->pool.lock);
+
+	if (!buf && posix_memalign(&buf, DISK_ALIGN, d->bsize) != 0) {
+		fprintf(stderr, "disk_buf_get: out of memory\n");
+		return NULL;
+	}
+
+	return buf;
+}
+
+void disk_buf_put(struct disk *d, void *buf)
+{
+	if (!buf)
+		return;
+
+	if ((d = pick(d, "disk_buf_put"))) {
+		pthread_mutex_lock(&d->pool.lock);
+		if (d->pool.len < POOL_MAX) {
+			d->pool.bufs[d->pool.len++] = buf;
+			buf = NULL;
+		}
+		pthread_mutex_unlock(&d->pool.lock);
+	}
+
+	free(buf);
+}
+
+void disk_buf_flush(struct disk *d)
+{
+	if (!(d = pick(d, "disk_buf_flush")))
+		return;
+
+	pthread_mutex_lock(&d->pool.lock);
+	while (d->pool.len)
+		free(d->pool.bufs[--d->pool.len]);
+	pthread_mutex_unlock(&d->pool.lock);
+}
+
+void disk_stats(struct disk *d, struct disk_stats *st)
+{
+	unsigned long *dst = (unsigned long *)st;
+	unsigned long *src;
+	size_t i;
+
+	memset(st, 0, sizeof(*st));
+	if (!(d = pick(d, "disk_stats")))
+		return;
+
+	src = (unsigned long *)&d->stats;
+	for (i = 0; i < sizeof(*st) / sizeof(*src); ++i)
+		dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+}
+
+void disk_stats_reset(struct disk *d)
+{
+	unsigned long *src;
+	size_t i;
+
+	if (!(d = pick(d, "disk_stats_reset")))
+		return;
+
+	src = (unsigned long *)&d->stats;
+	for (i = 0; i < sizeof(d->stats) / sizeof(*src); ++i)
+		__atomic_store_n(&src[i], 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&d->next, -1, __ATOMIC_RELAXED);
+}
+
+static void stats_dump_hist(const char *what, const unsigned long *hist)
+{
+	int i;
+
+	fprintf(stderr, "  %s latency (ns):\n", what);
+	for (i = 0; i < DISK_STATS_BUCKETS; ++i) {
+		if (hist[i])
+			fprintf(stderr, "    [%lu, %lu): %lu\n",
+				i ? 1UL << i : 0, 2UL << i, hist[i]);
+	}
+}
+
+void disk_stats_dump(struct disk *d)
+{
+	struct disk_stats st;
+
+	if (!(d = pick(d, "disk_stats_dump")))
+		return;
+
+	disk_stats(d, &st);
+
+	fprintf(stderr, "disk stats:\n");
+	fprintf(stderr, "  reads: %lu (%lu bytes)\n", st.reads, st.read_bytes);
+	fprintf(stderr, "  writes: %lu (%lu bytes)\n", st.writes,
+		st.write_bytes);
+	fprintf(stderr, "  sequential: %lu, random: %lu\n", st.sequential,
+		st.random);
+	stats_dump_hist("read", st.read_lat);
+	stats_dump_hist("write", st.write_lat);
+}
+
+int disk_blocks(struct disk *d)
+{
+	if (!(d = pick(d, "disk_blocks")))
+		return -1;
+
+	return d->nblocks;
+}
+
+int disk_block_size(struct disk *d)
+{
+	if (!(d = pick(d, "disk_block_size")))
+		return -1;
+
+	return d->bsize;
+}
+
+int disk_mode(struct disk *d)
+{
+	if (!(d = pick(d, "disk_mode")))
+		return -1;
+
+	return d->mode;
+}
+
+int disk_write(struct disk *d, int block, const void *buf)
+{
+	struct iovec iov;
+
+	if (!(d = pick(d, "block_write")))
+		return -1;
+
+	if ((block < 0) || (block >= d->nblocks)) {
 		fprintf(stderr, "block_write: block index out of bounds\n");
 		return -1;
 	}
 
-	if (lseek(handle, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("block_write: failed to lseek");
+	iov.iov_base = (void *)buf;
+	iov.iov_len = d->bsize;
+
+	return block_io(d, 1, block, &iov, 1);
+}
+
+int block_write(int block, const void *buf)
+{
+	return disk_write(NULL, block, buf);
+}
+
+int disk_read(struct disk *d, int block, void *buf)
+{
+	struct iovec iov;
+
+	if (!(d = pick(d, "block_read")))
 		return -1;
-	}
 
-	if (write(handle, buf, BLOCK_SIZE) < 0) {
-		perror("block_write: failed to write");
+	if ((block < 0) || (block >= d->nblocks)) {
+		fprintf(stderr, "block_read: block index out of bounds\n");
 		return -1;
 	}
 
-	return 0;
+	iov.iov_base = buf;
+	iov.iov_len = d->bsize;
+
+	return block_io(d, 0, block, &iov, 1);
 }
 
 int block_read(int block, void *buf)
 {
-	if (!active) {
-		fprintf(stderr, "block_read: disk not active\n");
-		return -1;
+	return disk_read(NULL, block, buf);
+}
+
+/* block_vec through the ring, batches of up to URING_DEPTH runs and VEC_MAX
+ * blocks per io_uring_enter. Returns how many of the blocks it transferred,
+ * which is fewer than cnt if O_DIRECT would need bounce buffers or the ring
+ * went away; the caller does the rest with positional I/O.
+ */
+static int block_vec_uring(struct disk *d, int write, int cnt,
+			   const int *blocks, void *const *bufs)
+{
+	struct uring_op ops[URING_DEPTH];
+	struct iovec iov[VEC_MAX];
+	int i, n, used, nops;
+
+	if (d->mode & DISK_DIRECT) {
+		for (i = 0; i < cnt; ++i) {
+			if ((uintptr_t)bufs[i] % DISK_ALIGN)
+				return 0;
+		}
 	}
 
-	if ((block < 0) || (block >= DISK_BLOCKS)) {
-		fprintf(stderr, "block_read: block index out of bounds\n");
-		return -1;
+	for (i = 0; (i < cnt) && (d->ring.fd >= 0);) {
+		for (nops = 0, used = 0;
+		     (i < cnt) && (nops < URING_DEPTH) && (used < VEC_MAX);
+		     ++nops, used += n, i += n) {
+			n = 0;
+			do {
+				iov[used + n].iov_base = bufs[i + n];
+				iov[used + n].iov_len = d->bsize;
+				++n;
+			} while ((i + n < cnt) &&
+				 (used + n < VEC_MAX) &&
+				 (blocks[i + n] == blocks[i] + n));
+
+			ops[nops].write = write;
+			ops[nops].block = blocks[i];
+			ops[nops].iov = iov + used;
+			ops[nops].cnt = n;
+		}
+
+		if (uring_io(d, ops, nops) < 0)
+			return -1;
 	}
 
-	if (lseek(handle, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("block_read: failed to lseek");
+	return i;
+}
+
+/* Shared body of the vectored calls: walk the request and hand every run of
+ * adjacent block numbers to block_io as one vector.
+ */
+static int block_vec(struct disk *d, int write, int cnt, const int *blocks,
+		     void *const *bufs)
+{
+	const char *who = write ? "block_writev" : "block_readv";
+	struct iovec iov[VEC_MAX];
+	int i = 0, n;
+
+	if (!(d = pick(d, who)))
 		return -1;
+
+	for (n = 0; n < cnt; ++n) {
+		if ((blocks[n] < 0) || (blocks[n] >= d->nblocks)) {
+			fprintf(stderr, "%s: block index out of bounds\n", who);
+			return -1;
+		}
 	}
 
-	if (read(handle, buf, BLOCK_SIZE) < 0) {
-		perror("block_read: failed to read");
-		return -1;
+	/* with a ring, every run is one entry and a whole batch of runs is
+	 * one submission */
+	if ((d->mode & DISK_URING) &&
+	    (pthread_mutex_trylock(&d->batch.lock) == 0)) {
+		if (d->ring.fd >= 0)
+			i = block_vec_uring(d, write, cnt, blocks, bufs);
+		pthread_mutex_unlock(&d->batch.lock);
+		if (i < 0)
+			return -1;
+	}
+
+	for (; i < cnt; i += n) {
+		n = 0;
+		do {
+			iov[n].iov_base = bufs[i + n];
+			iov[n].iov_len = d->bsize;
+			++n;
+		} while ((i + n < cnt) &&
+			 (n < VEC_MAX) &&
+			 (blocks[i + n] == blocks[i] + n));
+
+		if (block_io(d, write, blocks[i], iov, n) < 0)
+			return -1;
 	}
 
 	return 0;
 }
+
+int disk_writev(struct disk *d, int cnt, const int *blocks,
+		const void *const *bufs)
+{
+	return block_vec(d, 1, cnt, blocks, (void *const *)bufs);
+}
+
+int block_writev(int cnt, const int *blocks, const void *const *bufs)
+{
+	return disk_writev(NULL, cnt, blocks, bufs);
+}
+
+int disk_readv(struct disk *d, int cnt, const int *blocks, void *const *bufs)
+{
+	return block_vec(d, 0, cnt, blocks, bufs);
+}
+
+int block_readv(int cnt, const int *blocks, void *const *bufs)
+{
+	return disk_readv(NULL, cnt, blocks, bufs);
+}
+
+/* Writes that have returned only reached the host's page cache (or the
+ * mapping); push them down to stable storage.
+ */
+int disk_sync(struct disk *d)
+{
+	if (!(d = pick(d, "disk_sync")))
+		return -1;
+
+	if (d->map && msync(d->map - d->base, d->map_len, MS_SYNC) < 0) {
+		perror("disk_sync: failed to msync");
+		return -1;
+	}
+	if (fdatasync(d->handle) < 0) {
+		perror("disk_sync: failed to fdatasync");
+		return -1;
+	}
+	return 0;
+}
+
+int block_sync()
+{
+	return disk_sync(NULL);
+}
@@ -2,18 +2,142 @@
 #define _DISK_H_
 
 /******************************************************************************/
-#define DISK_BLOCKS  8192      /* number of blocks on the disk                */
-#define BLOCK_SIZE   4096      /* block size on "disk"                        */
+#define DISK_BLOCKS  8192      /* default number of blocks on the disk        */
+#define BLOCK_SIZE   4096      /* default block size on "disk"                */
+#define DISK_HDR_SIZE 4096     /* geometry header in front of block 0         */
+#define DISK_ALIGN   4096      /* buffer alignment for DISK_DIRECT transfers  */
+
+/******************************************************************************/
+#define DISK_MMAP    0x1       /* open_disk_flags: map the image, block I/O   */
+                               /* becomes memcpy, msync on close_disk         */
+#define DISK_PREALLOC 0x2      /* make_disk_flags: reserve the blocks with    */
+                               /* fallocate instead of leaving a sparse file  */
+#define DISK_DIRECT  0x4       /* open_disk_flags: bypass the host page cache */
+                               /* with O_DIRECT, unaligned buffers bounce     */
+                               /* through the buffer pool                     */
+#define DISK_STATS   0x8       /* open_disk_flags: disk_stats_dump() to       */
+                               /* stderr at close_disk                        */
+#define DISK_URING   0x10      /* open_disk_flags: block I/O through a Linux  */
+                               /* io_uring, positional I/O if there is none   */
+
+/******************************************************************************/
+#define DISK_STATS_BUCKETS 32  /* log2 latency buckets, [2^i, 2^(i+1)) ns,    */
+                               /* except bucket 0, which is [0, 2) ns         */
+
+/* Block I/O counters. A request is one transfer of adjacent blocks: a block_ */
+/* read/write, a run of a block_readv/writev, or a block_submit. It is        */
+/* sequential when it starts right where the previous request ended.          */
+struct disk_stats {
+	unsigned long reads;
+	unsigned long writes;
+	unsigned long read_bytes;
+	unsigned long write_bytes;
+	unsigned long sequential;
+	unsigned long random;
+	unsigned long read_lat[DISK_STATS_BUCKETS];
+	unsigned long write_lat[DISK_STATS_BUCKETS];
+};
+
+typedef void (*disk_done_fn)(void *arg, int status);
+                               /* block_submit completion, status 0 or -1     */
+
+/* An open virtual disk. open_disk/close_disk and the block_* calls work on  */
+/* a single default disk; disk_open hands out a handle instead, so several    */
+/* disks can be open at once. Calls that take a handle accept NULL for the    */
+/* default disk.                                                              */
+struct disk;
 
 /******************************************************************************/
 int make_disk(const char *name);     /* create an empty, virtual disk file          */
+int make_disk_flags(const char *name, int flags);
+                               /* create an empty disk with DISK_* options    */
+int make_disk_geometry(const char *name, int blocks, int block_size, int flags);
+                               /* create a disk of blocks blocks, block_size  */
+                               /* (a power of two >= 512) bytes each          */
 int open_disk(const char *name);     /* open a virtual disk (file)                  */
+int open_disk_flags(const char *name, int flags);
+                               /* open a virtual disk with DISK_* options     */
 int close_disk();              /* close a previously opened disk (file)       */
+struct disk *disk_open(const char *name, int flags);
+                               /* open another disk, NULL on failure          */
+int disk_close(struct disk *d);
+                               /* close a disk_open disk and free the handle  */
+int disk_blocks(struct disk *d);
+                               /* number of blocks on the disk                */
+int disk_block_size(struct disk *d);
+                               /* block size of the disk                      */
+int disk_mode(struct disk *d);
+                               /* DISK_* flags the disk runs with: those it   */
+                               /* was opened with, less the ones it fell back */
+                               /* from (no O_DIRECT, no io_uring)             */
+
+void *disk_buf_get(struct disk *d);
+                               /* one block buffer aligned to DISK_ALIGN,     */
+                               /* reused if one was put back, else newly      */
+                               /* allocated; NULL if out of memory            */
+void disk_buf_put(struct disk *d, void *buf);
+                               /* hand a disk_buf_get buffer back, kept for   */
+                               /* reuse up to a fixed number, else freed      */
+void disk_buf_flush(struct disk *d);
+                               /* free the buffers kept by the pool           */
+
+void disk_stats(struct disk *d, struct disk_stats *st);
+                               /* I/O counters since the disk was opened or   */
+                               /* the last disk_stats_reset                   */
+void disk_stats_reset(struct disk *d);
+                               /* zero the I/O counters                       */
+void disk_stats_dump(struct disk *d);
+                               /* print the I/O counters to stderr            */
 
+/* Block I/O is positional (pread/pwrite or memcpy on a mapping) and keeps no */
+/* seek state, so block calls may run concurrently from several threads, on   */
+/* one disk or on several. Concurrent writes to the same block are not        */
+/* ordered. Opening and closing a disk must not race with I/O on it.          */
 int block_write(int block, const void *buf);
-                               /* write a block of size BLOCK_SIZE to disk    */
+                               /* write a block of size disk_block_size()     */
 int block_read(int block, void *buf);
-                               /* read a block of size BLOCK_SIZE from disk   */
+                               /* read a block of size disk_block_size()      */
+int block_writev(int cnt, const int *blocks, const void *const *bufs);
+                               /* write bufs[i] to blocks[i], one pwritev per */
+                               /* run of adjacent blocks                      */
+int block_readv(int cnt, const int *blocks, void *const *bufs);
+                               /* read blocks[i] into bufs[i], one preadv per */
+                               /* run of adjacent blocks                      */
+int disk_write(struct disk *d, int block, const void *buf);
+int disk_read(struct disk *d, int block, void *buf);
+int disk_writev(struct disk *d, int cnt, const int *blocks,
+                const void *const *bufs);
+int disk_readv(struct disk *d, int cnt, const int *blocks, void *const *bufs);
+                               /* block_* on a given disk                     */
+int block_sync();              /* make completed writes durable               */
+int disk_sync(struct disk *d); /* block_sync on a given disk                  */
+
+/* Asynchronous block I/O: requests go on a bounded per-disk queue            */
+/* (submitting blocks while it is full) and are serviced by a pool of worker  */
+/* threads that is started on first use. done runs on a worker thread once a */
+/* request has completed. Closing a disk waits for everything in flight.      */
+int block_submit(int write, int block, int count, void *buf,
+                 disk_done_fn done, void *arg);
+                               /* queue a read (write == 0) or write of count */
+                               /* adjacent blocks to/from buf, done may be 0  */
+int disk_submit(struct disk *d, int write, int block, int count, void *buf,
+                disk_done_fn done, void *arg);
+                               /* block_submit on a given disk                */
+int disk_poll(struct disk *d); /* requests submitted but not yet completed    */
+int disk_drain(struct disk *d);/* wait for all requests, -1 if any failed     */
+
+/* Batched block I/O: requests are staged without any I/O and carried out    */
+/* together by block_flush, as one io_uring submission with DISK_URING. A     */
+/* full batch is flushed by the block_prep that finds it full. done runs on   */
+/* the flushing thread. Staged requests are not ordered among themselves.     */
+int block_prep(int write, int block, int count, void *buf,
+               disk_done_fn done, void *arg);
+                               /* stage a request like block_submit's         */
+int block_flush();             /* carry out the staged requests, -1 if any    */
+                               /* failed since the last flush                 */
+int disk_prep(struct disk *d, int write, int block, int count, void *buf,
+              disk_done_fn done, void *arg);
+int disk_flush(struct disk *d);/* block_prep/block_flush on a given disk      */
 /******************************************************************************/
 
 #endif
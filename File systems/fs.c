@@ -6,6 +6,9 @@
 #include <limits.h>
 #include <math.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 
 //custom headers
 #include "fs.h"
@@ -13,11 +16,19 @@
 
 //definitions
 #define MAX_FNAME_SIZE 16
-#define MAX_BLOCK_SIZE 4096                   // 4KB
-#define MAX_FILDES 32                         // max file descriptors
-#define MAX_FILES 64
-#define DISK_BLOCKS 8192
-#define BITMAP_SIZE (DISK_BLOCKS / 8)
+#define MAX_FILDES 32                         // default limit on open file descriptors
+#define MAX_FILES 64                          // inode table and directory size of make_fs
+#define FILES_LIMIT 65535                     // inode numbers are 16 bits in dentries and FDs
+#define FS_MAGIC 0xEC440F5                    // marks a disk formatted by make_fs
+#define IO_BATCH 64                           // blocks per block_readv/block_writev
+#define CACHE_BLOCKS 1024                     // default block cache capacity
+#define CACHE_MIN (2 * IO_BATCH)              // a pinned batch plus the pointer blocks it walks
+#define NUM_EXTENTS 5                         // extents kept in the inode itself
+#define RA_MIN 8                              // first read-ahead window, in blocks
+#define RA_MAX 256                            // largest read-ahead window, in blocks
+#define PEND_SLACK 4                          // pointer blocks flushing a pending buffer can take
+#define JOURNAL_MAGIC 0x4A524E4C              // marks a committed transaction in the journal
+#define JOURNAL_MS 1000                       // longest a change waits in memory for a commit
 
 //file types
 enum ftype{
@@ -26,22 +37,43 @@ enum ftype{
   NOTHING
 };
 
+//how an inode maps its data
+enum iformat{
+  BLOCKMAP,
+  EXTENTS
+};
+
 /* 
 Super Block: typically first block of the disk and stores info on other data structures 
   * For each persistent data structure, specify where it is on the disk
 */ 
 
 struct superblock {
-  // how many blocks are being used
-  uint16_t ub_bitmap_count;
+  // tells a formatted disk apart from garbage
+  uint32_t magic; 
+  // geometry of the disk, everything else is sized from these
+  uint32_t block_size; 
+  uint32_t disk_blocks; 
+  // how many blocks the bitmap takes up
+  uint32_t ub_bitmap_count;
   // where the list of blank and writted blocks start
-  uint16_t ub_bitmap_offset; 
+  uint32_t ub_bitmap_offset; 
   // how many blocks are used to keep a record of each file
-  uint16_t im_blocks; 
+  uint32_t im_blocks; 
   // number where the record of files start
-  uint16_t im_offset;
+  uint32_t im_offset;
   // set a flag to represent if superblock was modified in any way
   uint8_t dirty; 
+  // FS_* options from make_fs_flags
+  uint32_t flags; 
+  // inodes in the table and entries in the directory
+  uint32_t max_files; 
+  // where the directory entries are kept, right after the inode table
+  uint32_t dir_blocks; 
+  uint32_t dir_offset; 
+  // the metadata journal, right after the directory
+  uint32_t journal_blocks; 
+  uint32_t journal_offset; 
 };
 
 /* 
@@ -62,23 +94,42 @@ struct dentry{
 Inode: Metadata for files 
   * Map a file to the locations of its potentially non-contiguous data on disk
 */
+struct extent{
+  // first block of the run and how many blocks it has
+  uint32_t start; 
+  uint32_t len; 
+};
+
 struct inode{
   // file type
   enum ftype type; 
   // file size in bytes
   uint32_t size; 
-  // points directly to data blocks
-  uint16_t direct_offset[10]; 
-  // points to a list of direct block addresses
-  uint16_t single_indirect;
-  // points to a block containing a list of single indirect block addresses
-  uint16_t double_indirect;
+  // data blocks, mapped the way format says
+  union{
+    struct{
+      // points directly to data blocks
+      uint32_t direct_offset[10]; 
+      // points to a list of direct block addresses
+      uint32_t single_indirect;
+      // points to a block containing a list of single indirect block addresses
+      uint32_t double_indirect;
+    } blk; 
+    struct{
+      // runs of contiguous blocks in file order, the ones past NUM_EXTENTS in the overflow block
+      struct extent list[NUM_EXTENTS]; 
+      uint32_t count; 
+      uint32_t overflow; 
+    } ext; 
+  } map; 
   // is it in use?
   uint8_t is_used;
   //index in its array
-  uint8_t inode_num;
+  uint16_t inode_num;
   // dirty? 
   uint8_t dirty; 
+  // enum iformat, BLOCKMAP unless the file system was made with FS_EXTENTS
+  uint8_t format; 
 };
 
 /* 
@@ -92,107 +143,1898 @@ struct FD{
   // inode number
   uint16_t inode_num;
   // position within file
-  uint16_t offset; 
+  uint32_t offset; 
+  // read-ahead: the block a sequential read would start at, the current window and the
+  // block up to which reads have already been started
+  uint32_t ra_next; 
+  uint32_t ra_window; 
+  uint32_t ra_end; 
+}; 
+
+struct bitmap_info{
+  // ub_bitmap_count whole blocks, allocated once the disk size is known. Block b is bit b % 64
+  // of word b / 64, the same bits as a byte-wise bitmap on a little-endian host
+  uint64_t* ub_bitmap;
+  size_t nwords; 
+  // next-fit: the word the last allocation ended in, and how many blocks are still free
+  size_t cursor; 
+  size_t nfree; 
+  // free blocks promised to the pending buffers of fs_write, see pend_room
+  size_t reserved; 
+  // blocks freed since the last commit, in the same bits: free in the bitmap write_back
+  // writes, still taken for allocation until the transaction that frees them is durable
+  uint64_t* held; 
+  size_t nheld; 
+  uint8_t dirty; 
+};
+
+/*
+Block cache: write-back cache of data and pointer blocks between the file system and the disk
+  * Entries are found through a hash of the block number and replaced with CLOCK
+  * Dirty entries reach the disk when the cache needs room, on fs_sync and at umount_fs
+  * Entries handed out by cache_getv are pinned (can't be replaced) until cache_putv
+  * Read-ahead fills entries on the disk's worker threads; they stay pinned, and aren't
+    looked at, until cache_reap sees the read has finished
+*/
+struct cbuf{
+  uint32_t block; 
+  char* data; 
+  // next entry in the same hash chain, -1 ends it
+  int next; 
+  // holds block, uptodate once data has been read or filled in
+  uint8_t used; 
+  uint8_t uptodate; 
+  uint8_t dirty; 
+  // CLOCK reference bit
+  uint8_t ref; 
+  uint16_t pins; 
+  // set while a read-ahead into data is in flight, cleared by the worker that did it; a
+  // read-ahead covers ra_count entries from this one on, for as many adjacent blocks
+  int ra_busy; 
+  int ra_status; 
+  uint16_t ra_count; 
+};
+
+struct block_cache{
+  // capacity in blocks, applied at the next mount (or fs_cache_size while mounted)
+  size_t capacity; 
+  struct cbuf* bufs; 
+  size_t nbufs; 
+  // chain heads, nhash is a power of two
+  int* hash; 
+  size_t nhash; 
+  size_t hand; 
+  char* mem; 
+  // scratch for cache_writeback, nbufs entries each
+  struct cbuf** order; 
+  int* wb_blocks; 
+  void** wb_bufs; 
+  // entries with a read-ahead started, at most nbufs / 4 of them
+  struct cbuf** ra; 
+  size_t nra; 
+};
+
+/*
+Block map: the pointer blocks of an inode, kept in memory once a lookup has needed them
+  * Lets get_block map any block of a file without touching the disk or the block cache
+  * Dirty pointer blocks go back through the block cache in write_back
+*/
+struct imap{
+  // contents of single_indirect, NULL until loaded
+  uint32_t* single; 
+  uint8_t single_dirty; 
+  // contents of double_indirect and of the pointer blocks it lists
+  uint32_t* dbl; 
+  uint8_t dbl_dirty; 
+  uint32_t** leaves; 
+  uint8_t* leaf_dirty; 
+  // EXTENTS: contents of the overflow block, and the last extent a lookup landed in
+  struct extent* more; 
+  uint8_t more_dirty; 
+  uint32_t hint; 
+  uint32_t hint_logical; 
+  // contiguous blocks fs_write set aside for the data blocks it is about to allocate
+  uint32_t run_next; 
+  uint32_t run_left; 
+  // delayed allocation: pend_count blocks of new data from file block pend_first on, waiting
+  // in pend (IO_BATCH blocks, allocated on first use) for disk blocks
+  char* pend; 
+  uint32_t pend_first; 
+  uint32_t pend_count; 
+};
+
+/*
+Directory index: open-addressing hash table from file names to root[] entries
+  * nslots is a power of two, at least twice the number of entries, probed linearly
+  * A removal moves later entries of the probe run back instead of leaving a tombstone
+  * Rebuilt from root[] at mount_fs, kept up to date by fs_create and fs_delete
+*/
+struct dir_index{
+  // root[] index per slot, -1 for an empty one
+  int* slots; 
+  size_t nslots; 
+  // per directory block on disk, whether its entries changed since it was written
+  uint8_t* dirty; 
+  // where fs_create starts looking for a free dentry and a free inode
+  size_t dentry_hint; 
+  size_t inode_hint; 
+};
+
+/*
+Journal: the last metadata transaction, in the journal_blocks blocks at journal_offset
+  * A jheader and its targets take the first blocks, the blocks of the transaction follow
+    them in order. There is room for every block of the tables, so a transaction never has to
+    be split
+  * write_back gathers the superblock, bitmap, inode table and directory blocks that changed
+    into a batch; committing it writes the batch to the journal, and only once that is on
+    the disk writes the blocks in place
+  * mount_fs writes a committed transaction in place again, in case a crash cut that short;
+    sum covers the header and the blocks, so a transaction that wasn't all written is ignored
+  * Data and pointer blocks aren't logged, they reach the disk before the transaction does;
+    a freed block isn't reused until the transaction that frees it is in the journal
+*/
+struct jheader{
+  uint32_t magic; 
+  uint32_t seq; 
+  // blocks in the transaction, and FNV-1a of the header (with sum zero) and the blocks
+  uint32_t count; 
+  uint32_t sum; 
+  // where each block of the transaction goes
+  uint32_t targets[]; 
+};
+
+struct journal_info{
+  // desc blocks for the header, then cap blocks of the batch
+  char* buf; 
+  size_t desc; 
+  size_t cap; 
+  size_t count; 
+  // per block of buf, header included: where in the journal it goes and its address; then
+  // per batch entry: where it goes in place and what to mark clean once it is there
+  int* jblocks; 
+  void** bufs; 
+  int* blocks; 
+  void (**clean)(size_t); 
+  size_t* clean_arg; 
+  uint32_t seq; 
+  // a transaction was committed since mount_fs, umount_fs marks the journal empty
+  uint8_t used; 
+  // calls that changed something since the last write_back; the commit thread writes them
+  // back every JOURNAL_MS, so that many calls share a commit
+  size_t ops; 
+  pthread_t thread; 
+  uint8_t running; 
+  uint8_t stop; 
+  pthread_mutex_t lock; 
+  pthread_cond_t wake; 
+};
+
+/*
+In-memory tables, sized from fs.max_files at mount_fs
+  * The inode table is read in a block at a time, the first time one of its inodes is needed
+  * root[] is read whole at mount_fs, write_back writes only the directory blocks that changed
+  * The descriptor table grows on demand, up to fd_limit entries
+*/
+struct superblock fs; 
+struct bitmap_info ubm; 
+struct block_cache cache = { .capacity = CACHE_BLOCKS }; 
+struct dentry* root = NULL; 
+struct FD* fds = NULL; 
+size_t nfds = 0; 
+size_t fd_limit = MAX_FILDES; 
+size_t fd_hint = 0; 
+struct inode* inodes = NULL; 
+uint8_t* inode_loaded = NULL; 
+uint32_t* open_count = NULL; 
+struct imap* imaps = NULL; 
+struct dir_index dir; 
+
+bool mounted = false; 
+struct disk* dsk = NULL; /* disk the file system lives on, from disk_open */
+bool readahead = false; /* whether fs_read reads ahead, only on disks the host page cache doesn't */
+
+/*
+Locking: the calls of fs.h can be made from any number of threads
+  * dir_lock: the mount itself, the directory and the descriptor table. Held for writing by
+    the calls that change them, mount_fs, umount_fs and fs_sync; held for reading by the
+    calls that work on an open file, which is all that reads and writes do
+  * ilocks[i].rw: the data and size of inode i. Shared by fs_read, fs_pread, fs_lseek and
+    fs_get_filesize, held alone by fs_write, fs_pwrite and fs_truncate
+  * ilocks[i].map: the block map of inode i between readers sharing rw, since lookups load
+    pointer blocks and move the extent hint
+  * bitmap_lock: the block bitmap, its counters and reserved runs
+  * cache_lock: the block cache; entries handed out pinned are used without it
+  * journal.lock: starting and stopping the commit thread, which takes dir_lock for writing
+    to commit and is stopped before umount_fs takes it
+  Locks are taken in that order; a call holding dir_lock for writing has everything to itself
+  and takes none of the others. A descriptor is used by one thread at a time, except through
+  fs_pread and fs_pwrite, which leave it alone.
+*/
+struct ilock{
+  pthread_rwlock_t rw; 
+  pthread_mutex_t map; 
 }; 
 
-struct bitmap_info{
-  uint8_t ub_bitmap[DISK_BLOCKS / CHAR_BIT];
-  uint8_t dirty; 
-};
+pthread_rwlock_t dir_lock = PTHREAD_RWLOCK_INITIALIZER; 
+struct ilock* ilocks = NULL; 
+pthread_mutex_t bitmap_lock = PTHREAD_MUTEX_INITIALIZER; 
+pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER; 
+struct journal_info journal = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER }; 
+
+// index of inode in inodes[] and in the tables kept alongside it
+size_t inode_slot(const struct inode* inode){
+  return inode - inodes; 
+}
+
+size_t dir_slot(const char* name){
+  // FNV-1a
+  uint32_t h = 2166136261u; 
+  for(; *name; name++){
+    h = (h ^ (uint8_t) *name) * 16777619u; 
+  }
+  return h & (dir.nslots - 1); 
+}
+
+// root[] index of the file called name, -1 if there is none
+int dir_find(const char* name){
+  for(size_t s = dir_slot(name); dir.slots[s] != -1; s = (s + 1) & (dir.nslots - 1)){
+    if(strcmp(root[dir.slots[s]].name, name) == 0){
+      return dir.slots[s]; 
+    }
+  }
+  return -1; 
+}
+
+void dir_insert(int idx){
+  size_t s = dir_slot(root[idx].name); 
+  while(dir.slots[s] != -1){
+    s = (s + 1) & (dir.nslots - 1); 
+  }
+  dir.slots[s] = idx; 
+}
+
+void dir_remove(int idx){
+  size_t s = dir_slot(root[idx].name); 
+  while(dir.slots[s] != idx){
+    s = (s + 1) & (dir.nslots - 1); 
+  }
+
+  // pull back every later entry of the run that may no longer sit past its home slot
+  size_t hole = s; 
+  for(s = (s + 1) & (dir.nslots - 1); dir.slots[s] != -1; s = (s + 1) & (dir.nslots - 1)){
+    size_t home = dir_slot(root[dir.slots[s]].name); 
+    if(((s - home) & (dir.nslots - 1)) >= ((s - hole) & (dir.nslots - 1))){
+      dir.slots[hole] = dir.slots[s]; 
+      hole = s; 
+    }
+  }
+  dir.slots[hole] = -1; 
+}
+
+// the directory block holding root[idx] has to be written back
+void dir_touch(int idx){
+  dir.dirty[idx / (fs.block_size / sizeof(struct dentry))] = true; 
+}
+
+// index every entry of root[], -1 when out of memory
+int dir_rebuild(){
+  size_t nslots = 1; 
+  while(nslots < 2 * fs.max_files){
+    nslots *= 2; 
+  }
+  if(nslots != dir.nslots){
+    int* slots = realloc(dir.slots, nslots * sizeof(int)); 
+    if(slots == NULL){
+      return -1; 
+    }
+    dir.slots = slots; 
+    dir.nslots = nslots; 
+  }
+
+  for(size_t s = 0; s < dir.nslots; s++){
+    dir.slots[s] = -1; 
+  }
+  for(size_t i = 0; i < fs.max_files; i++){
+    if(root[i].is_used){
+      dir_insert(i); 
+    }
+  }
+  dir.dentry_hint = 0; 
+  dir.inode_hint = 0; 
+  return 0; 
+}
+
+/*
+  BITMAP hints: 
+    * 1 bit per block indicating if it's free or not
+    * All of the bits get combined into one long series of bits and written to a location on disk 
+    * biggest data tpye we have is 64 bits, but we need ~8192
+    * Solution: use an array: used_block_bitmap[disk_blocks / CHAR_BIT]
+    * Write helper functions to perform single bit operations 
+      * get, set, clear
+      * (/), (%), (&) will help!  
+*/
+
+void initialize_fs_structs() {
+    // Initialize the superblock
+    fs.magic = 0; 
+    fs.block_size = 0; 
+    fs.disk_blocks = 0; 
+    fs.ub_bitmap_count = 0;
+    fs.ub_bitmap_offset = 0;
+    fs.im_blocks = 0;
+    fs.im_offset = 0;
+    fs.dirty = false;
+
+    free(ubm.ub_bitmap); 
+    free(ubm.held); 
+    memset(&ubm, 0, sizeof(ubm)); 
+}
+
+
+void set_bit(int block_num){
+  uint64_t bit = (uint64_t) 1 << (block_num % 64); 
+  if(!(ubm.ub_bitmap[block_num / 64] & bit)){
+    ubm.ub_bitmap[block_num / 64] |= bit; 
+    ubm.nfree--; 
+  }
+  ubm.dirty = true; 
+}
+
+int get_bit(int block_num){
+  return (ubm.ub_bitmap[block_num / 64] >> (block_num % 64)) & 1; 
+}
+
+void cache_forget(uint32_t block); 
+
+void clear_bit(int block_num){
+  pthread_mutex_lock(&bitmap_lock); 
+  uint64_t bit = (uint64_t) 1 << (block_num % 64); 
+  if(ubm.ub_bitmap[block_num / 64] & bit){
+    ubm.ub_bitmap[block_num / 64] &= ~bit; 
+    ubm.nfree++; 
+  }
+  ubm.dirty = true; 
+  // a freed block's cached contents must never be written back over its next owner
+  pthread_mutex_lock(&cache_lock); 
+  cache_forget(block_num); 
+  pthread_mutex_unlock(&cache_lock); 
+  pthread_mutex_unlock(&bitmap_lock); 
+}
+
+/*
+  Free a block the committed metadata may still point at. It is held back from allocation
+  until the transaction that frees it is in the journal: data written to it before then would
+  land in the old owner's file after a crash. Blocks no committed metadata can name, like a
+  reserved run's leftovers, go back right away with clear_bit.
+*/
+void free_block(int block_num){
+  pthread_mutex_lock(&bitmap_lock); 
+  uint64_t bit = (uint64_t) 1 << (block_num % 64); 
+  if((ubm.ub_bitmap[block_num / 64] & bit) && !(ubm.held[block_num / 64] & bit)){
+    ubm.held[block_num / 64] |= bit; 
+    ubm.nheld++; 
+  }
+  ubm.dirty = true; 
+  pthread_mutex_lock(&cache_lock); 
+  cache_forget(block_num); 
+  pthread_mutex_unlock(&cache_lock); 
+  pthread_mutex_unlock(&bitmap_lock); 
+}
+
+// hand the held blocks out again, once the transaction that frees them is durable
+void bitmap_release(){
+  if(ubm.nheld == 0){
+    return; 
+  }
+  for(size_t w = 0; w < ubm.nwords; w++){
+    if(ubm.held[w]){
+      ubm.ub_bitmap[w] &= ~ubm.held[w]; 
+      ubm.nfree += __builtin_popcountll(ubm.held[w]); 
+      ubm.held[w] = 0; 
+    }
+  }
+  ubm.nheld = 0; 
+}
+
+/*
+  Get a freshly loaded or cleared bitmap ready for allocation: the bits past the last block
+  are marked used so a scan never hands them out, and the free blocks are counted once.
+*/
+void bitmap_init(){
+  ubm.nwords = (size_t) fs.ub_bitmap_count * fs.block_size / sizeof(uint64_t); 
+  for(size_t b = fs.disk_blocks; b < ubm.nwords * 64; b++){
+    ubm.ub_bitmap[b / 64] |= (uint64_t) 1 << (b % 64); 
+  }
+
+  ubm.nfree = 0; 
+  for(size_t w = 0; w < ubm.nwords; w++){
+    ubm.nfree += 64 - __builtin_popcountll(ubm.ub_bitmap[w]); 
+  }
+  ubm.cursor = 0; 
+  ubm.reserved = 0; 
+}
+
+/*
+  Allocate up to want contiguous blocks: the first free block at or after the next-fit cursor
+  (wrapping around) and as many free blocks right after it. Returns the first block and sets
+  *got, -1 when the disk is full. Blocks reserved for pending buffers count as taken.
+*/
+int get_free_run(size_t want, size_t* got){
+  pthread_mutex_lock(&bitmap_lock); 
+  if(ubm.nfree <= ubm.reserved){
+    pthread_mutex_unlock(&bitmap_lock); 
+    return -1; 
+  }
+  if(want > ubm.nfree - ubm.reserved){
+    want = ubm.nfree - ubm.reserved; 
+  }
+
+  size_t w = ubm.cursor; 
+  while(ubm.ub_bitmap[w] == ~(uint64_t) 0){
+    w = (w + 1 == ubm.nwords) ? 0 : w + 1; 
+  }
+
+  size_t start = w * 64 + __builtin_ctzll(~ubm.ub_bitmap[w]); 
+  size_t len = 0; 
+  while(len < want && start + len < fs.disk_blocks && get_bit(start + len) == 0){
+    set_bit(start + len); 
+    len++; 
+  }
+
+  ubm.cursor = (start + len) / 64 < ubm.nwords ? (start + len) / 64 : 0; 
+  pthread_mutex_unlock(&bitmap_lock); 
+  *got = len; 
+  return start; 
+}
+
+int get_free_block(){
+  size_t got; 
+  return get_free_run(1, &got); 
+}
+
+// give back the blocks of inode's run that were never used
+void release_run(struct inode* inode){
+  struct imap* m = &imaps[inode_slot(inode)]; 
+  for(; m->run_left > 0; m->run_left--){
+    clear_bit(m->run_next++); 
+  }
+}
+
+/*
+  Set aside up to n contiguous blocks for the data blocks inode is about to get, giving back
+  whatever is left of an earlier run first. Nothing is set aside on a full disk.
+*/
+void reserve_run(struct inode* inode, size_t n){
+  struct imap* m = &imaps[inode_slot(inode)]; 
+  release_run(inode); 
+  if(n == 0){
+    return; 
+  }
+
+  size_t got; 
+  int start = get_free_run(n, &got); 
+  if(start != -1){
+    m->run_next = start; 
+    m->run_left = got; 
+  }
+}
+
+/*
+  A new data block for inode: the next one of its reserved run, else near when that is free
+  (0 for no preference), else any free block. -1 on a full disk.
+*/
+int alloc_block(struct inode* inode, uint32_t near){
+  struct imap* m = &imaps[inode_slot(inode)]; 
+  if(m->run_left > 0){
+    m->run_left--; 
+    return m->run_next++; 
+  }
+  pthread_mutex_lock(&bitmap_lock); 
+  if(near != 0 && near < fs.disk_blocks && ubm.nfree > ubm.reserved && get_bit(near) == 0){
+    set_bit(near); 
+    pthread_mutex_unlock(&bitmap_lock); 
+    return near; 
+  }
+  pthread_mutex_unlock(&bitmap_lock); 
+  return get_free_block(); 
+}
+
+// n blocks worth of memory aligned for DISK_DIRECT transfers, NULL when out of memory
+void* alloc_blocks(size_t n){
+  void* mem = NULL; 
+  if(posix_memalign(&mem, DISK_ALIGN, n * fs.block_size) != 0){
+    return NULL; 
+  }
+  return mem; 
+}
+
+size_t cache_slot(uint32_t block){
+  return (block * 2654435761u) & (cache.nhash - 1); 
+}
+
+int cache_find(uint32_t block){
+  for(int i = cache.hash[cache_slot(block)]; i != -1; i = cache.bufs[i].next){
+    if(cache.bufs[i].block == block){
+      return i; 
+    }
+  }
+  return -1; 
+}
+
+void cache_unhash(int idx){
+  int* link = &cache.hash[cache_slot(cache.bufs[idx].block)]; 
+  while(*link != idx){
+    link = &cache.bufs[*link].next; 
+  }
+  *link = cache.bufs[idx].next; 
+  cache.bufs[idx].used = false; 
+  cache.bufs[idx].uptodate = false; 
+  cache.bufs[idx].dirty = false; 
+}
+
+void cache_reap(bool wait); 
+
+void cache_free(){
+  cache_reap(true); 
+  free(cache.bufs); 
+  free(cache.hash); 
+  free(cache.mem); 
+  free(cache.order); 
+  free(cache.wb_blocks); 
+  free(cache.wb_bufs); 
+  free(cache.ra); 
+
+  size_t capacity = cache.capacity; 
+  memset(&cache, 0, sizeof(cache)); 
+  cache.capacity = capacity; 
+}
+
+// set up an empty cache of cache.capacity blocks for the mounted file system
+int cache_init(){
+  cache.nbufs = cache.capacity; 
+  for(cache.nhash = 1; cache.nhash < cache.nbufs; cache.nhash <<= 1); 
+
+  cache.bufs = calloc(cache.nbufs, sizeof(struct cbuf)); 
+  cache.hash = malloc(cache.nhash * sizeof(int)); 
+  cache.mem = alloc_blocks(cache.nbufs); 
+  cache.order = malloc(cache.nbufs * sizeof(struct cbuf*)); 
+  cache.wb_blocks = malloc(cache.nbufs * sizeof(int)); 
+  cache.wb_bufs = malloc(cache.nbufs * sizeof(void*)); 
+  cache.ra = malloc(cache.nbufs * sizeof(struct cbuf*)); 
+  if(!cache.bufs || !cache.hash || !cache.mem || !cache.order || !cache.wb_blocks || !cache.wb_bufs || !cache.ra){
+    fprintf(stderr, "ERROR: Failure to allocate block cache!\n"); 
+    cache_free(); 
+    return -1; 
+  }
+
+  for(size_t i = 0; i < cache.nhash; i++){
+    cache.hash[i] = -1; 
+  }
+  for(size_t i = 0; i < cache.nbufs; i++){
+    cache.bufs[i].data = cache.mem + i * fs.block_size; 
+    cache.bufs[i].next = -1; 
+  }
+  return 0; 
+}
+
+int cache_cmp(const void* a, const void* b){
+  uint32_t x = (*(struct cbuf* const*) a)->block; 
+  uint32_t y = (*(struct cbuf* const*) b)->block; 
+  return (x > y) - (x < y); 
+}
+
+/*
+  Write every dirty entry back. They go out sorted by block number in one block_writev, so
+  a file written sequentially reaches the disk as a few long runs. Pinned entries may be in
+  the middle of an fs_write on another thread and wait for the next write-back.
+*/
+int cache_writeback(){
+  size_t n = 0; 
+  for(size_t i = 0; i < cache.nbufs; i++){
+    if(cache.bufs[i].pins == 0 && cache.bufs[i].used && cache.bufs[i].dirty){
+      cache.order[n++] = &cache.bufs[i]; 
+    }
+  }
+  if(n == 0){
+    return 0; 
+  }
+
+  qsort(cache.order, n, sizeof(struct cbuf*), cache_cmp); 
+  for(size_t i = 0; i < n; i++){
+    cache.wb_blocks[i] = cache.order[i]->block; 
+    cache.wb_bufs[i] = cache.order[i]->data; 
+  }
+
+  if(disk_writev(dsk, n, cache.wb_blocks, (const void* const*) cache.wb_bufs) != 0){
+    fprintf(stderr, "ERROR: Failed to write back cached blocks!\n"); 
+    return -1; 
+  }
+
+  for(size_t i = 0; i < n; i++){
+    cache.order[i]->dirty = false; 
+  }
+  return 0; 
+}
+
+// pick an entry to reuse with CLOCK, -1 if everything is pinned
+int cache_victim(){
+  for(size_t step = 0; step < 2 * cache.nbufs + 1; step++){
+    int idx = cache.hand; 
+    struct cbuf* e = &cache.bufs[idx]; 
+    cache.hand = (cache.hand + 1) % cache.nbufs; 
+
+    if(e->pins){
+      continue; 
+    }
+    if(e->used && e->ref){
+      e->ref = false; 
+      continue; 
+    }
+
+    if(e->dirty && cache_writeback() != 0){
+      return -1; 
+    }
+    if(e->used){
+      cache_unhash(idx); 
+    }
+    return idx; 
+  }
+
+  fprintf(stderr, "ERROR: Block cache is full of pinned blocks!\n"); 
+  return -1; 
+}
+
+void cache_putv(struct cbuf** ents, size_t n){
+  for(size_t i = 0; i < n; i++){
+    ents[i]->pins--; 
+  }
+}
+
+/*
+  Read in the entries of ents[0..n) that don't hold their block yet, with a single
+  block_readv. The entries stay pinned either way.
+*/
+int cache_fill(struct cbuf** ents, size_t n){
+  int miss_blocks[IO_BATCH]; 
+  void* miss_bufs[IO_BATCH]; 
+  size_t nmiss = 0; 
+
+  for(size_t i = 0; i < n; i++){
+    if(!ents[i]->uptodate){
+      miss_blocks[nmiss] = ents[i]->block; 
+      miss_bufs[nmiss] = ents[i]->data; 
+      nmiss++; 
+    }
+  }
+
+  if(nmiss > 0){
+    if(disk_readv(dsk, nmiss, miss_blocks, miss_bufs) != 0){
+      fprintf(stderr, "ERROR: Failed to read blocks!\n"); 
+      return -1; 
+    }
+    for(size_t i = 0; i < n; i++){
+      ents[i]->uptodate = true; 
+    }
+  }
+  return 0; 
+}
+
+// give block an entry of its own, nothing read yet; -1 if everything is pinned
+int cache_insert(uint32_t block){
+  int idx = cache_victim(); 
+  if(idx == -1){
+    return -1; 
+  }
+  struct cbuf* e = &cache.bufs[idx]; 
+  e->block = block; 
+  e->used = true; 
+  e->uptodate = false; 
+  e->dirty = false; 
+  e->next = cache.hash[cache_slot(block)]; 
+  cache.hash[cache_slot(block)] = idx; 
+  return idx; 
+}
+
+/*
+  Pin the cache entries for blocks[0..n), n <= IO_BATCH. With read set, the ones that are
+  not cached yet are fetched with cache_fill; without it the caller is about to fill them in
+  and sets uptodate itself.
+*/
+int cache_getv(const uint32_t* blocks, size_t n, struct cbuf** ents, bool read){
+  for(size_t i = 0; i < n; i++){
+    int idx = cache_find(blocks[i]); 
+    if(idx != -1 && cache.nra > 0 && cache.bufs[idx].pins > 0){
+      // the block may be on its way in already: wait for just that read, and settle it before
+      // the entry is handed out, or write-back would pass over it as pinned
+      while(__atomic_load_n(&cache.bufs[idx].ra_busy, __ATOMIC_ACQUIRE)){
+        sched_yield(); 
+      }
+      cache_reap(false); 
+      idx = cache_find(blocks[i]); 
+    }
+    if(idx == -1 && (idx = cache_insert(blocks[i])) == -1){
+      cache_putv(ents, i); 
+      return -1; 
+    }
+
+    ents[i] = &cache.bufs[idx]; 
+    ents[i]->pins++; 
+    ents[i]->ref = true; 
+  }
+
+  if(read && cache_fill(ents, n) != 0){
+    cache_putv(ents, n); 
+    return -1; 
+  }
+  return 0; 
+}
+
+/*
+  The cache entry for one block, not pinned: the pointer is good until the next cache call.
+  NULL on failure.
+*/
+struct cbuf* cache_get(uint32_t block, bool read){
+  struct cbuf* e; 
+  if(cache_getv(&block, 1, &e, read) != 0){
+    return NULL; 
+  }
+  cache_putv(&e, 1); 
+  return e; 
+}
+
+/*
+  Drop a freed block from the cache, dirty or not. A read-ahead keeps its entries pinned until
+  it is reaped, waiting for it first if it is still in flight, so it can't mark the entry
+  uptodate once the block has a new owner. A caller still holding the entry pinned keeps it
+  out of the hash and out of write-back.
+*/
+void cache_forget(uint32_t block){
+  if(cache.bufs == NULL){
+    return; 
+  }
+  int idx = cache_find(block); 
+  if(idx != -1 && cache.bufs[idx].pins > 0 && cache.nra > 0){
+    cache_reap(__atomic_load_n(&cache.bufs[idx].ra_busy, __ATOMIC_ACQUIRE)); 
+    idx = cache_find(block); 
+  }
+  if(idx != -1){
+    cache_unhash(idx); 
+  }
+}
+
+// disk_submit callback of a read-ahead, on a worker thread: hands the entries back to cache_reap
+void cache_ra_done(void* arg, int status){
+  struct cbuf* e = arg; 
+  // once an entry is released the cache may settle and drop it, so count is read first
+  size_t count = e->ra_count; 
+  for(size_t i = 0; i < count; i++){
+    e[i].ra_status = status; 
+    __atomic_store_n(&e[i].ra_busy, 0, __ATOMIC_RELEASE); 
+  }
+}
+
+/*
+  Settle the read-aheads that have finished, or all of them after waiting with wait set: the
+  entries are unpinned and hold their block if the read worked, else they are dropped.
+*/
+void cache_reap(bool wait){
+  if(cache.nra == 0){
+    return; 
+  }
+  if(wait){
+    disk_drain(dsk); 
+  }
+
+  size_t kept = 0; 
+  for(size_t i = 0; i < cache.nra; i++){
+    struct cbuf* e = cache.ra[i]; 
+    if(__atomic_load_n(&e->ra_busy, __ATOMIC_ACQUIRE)){
+      cache.ra[kept++] = e; 
+      continue; 
+    }
+    e->pins--; 
+    if(e->ra_status == 0){
+      e->uptodate = true; 
+    }
+    else if(e->pins == 0){
+      cache_unhash(e - cache.bufs); 
+    }
+  }
+  cache.nra = kept; 
+}
+
+// start the read-ahead of count adjacent blocks into as many adjacent entries from idx on
+int cache_ra_submit(int idx, size_t count){
+  struct cbuf* e = &cache.bufs[idx]; 
+  e->ra_count = count; 
+  for(size_t i = 0; i < count; i++){
+    e[i].pins++; 
+    e[i].ref = true; 
+    e[i].ra_busy = 1; 
+  }
+
+  if(disk_submit(dsk, 0, e->block, count, e->data, cache_ra_done, e) != 0){
+    for(size_t i = 0; i < count; i++){
+      e[i].pins--; 
+      e[i].ra_busy = 0; 
+      cache_unhash(idx + i); 
+    }
+    return -1; 
+  }
+  for(size_t i = 0; i < count; i++){
+    cache.ra[cache.nra++] = &e[i]; 
+  }
+  return 0; 
+}
+
+/*
+  Start reading blocks[0..n) into the cache in the background, skipping the ones that are
+  cached already. CLOCK tends to hand out neighbouring entries, so a run of adjacent blocks
+  that lands in adjacent entries goes to the disk as one request. Stops early rather than
+  pinning more than a quarter of the cache.
+*/
+void cache_readahead(const uint32_t* blocks, size_t n){
+  cache_reap(false); 
+
+  int run = -1; 
+  size_t len = 0; 
+  for(size_t i = 0; i < n && cache.nra + len < cache.nbufs / 4; i++){
+    if(cache_find(blocks[i]) != -1){
+      continue; 
+    }
+
+    // pin the run so far, the next victim must not be one of its entries
+    for(size_t j = 0; j < len; j++){
+      cache.bufs[run + j].pins++; 
+    }
+    int idx = cache_insert(blocks[i]); 
+    for(size_t j = 0; j < len; j++){
+      cache.bufs[run + j].pins--; 
+    }
+    if(idx == -1){
+      break; 
+    }
+
+    if(len > 0 && len < IO_BATCH && idx == run + (int) len && blocks[i] == cache.bufs[run].block + len){
+      len++; 
+      continue; 
+    }
+    if(len > 0 && cache_ra_submit(run, len) != 0){
+      cache_unhash(idx); 
+      return; 
+    }
+    run = idx; 
+    len = 1; 
+  }
+
+  if(len > 0){
+    cache_ra_submit(run, len); 
+  }
+}
+
+/*
+  In-memory copy of the pointer block ib, read through the cache, or a zeroed one for a block
+  that was just allocated (ib's old contents are stale pointers). NULL on failure.
+*/
+uint32_t* imap_load(uint32_t ib, bool fresh){
+  uint32_t* ptrs = malloc(fs.block_size); 
+  if(ptrs == NULL){
+    fprintf(stderr, "ERROR: Failure to allocate block map!\n"); 
+    return NULL; 
+  }
+  if(fresh){
+    memset(ptrs, 0, fs.block_size); 
+    return ptrs; 
+  }
+
+  pthread_mutex_lock(&cache_lock); 
+  struct cbuf* e = cache_get(ib, true); 
+  if(e == NULL){
+    pthread_mutex_unlock(&cache_lock); 
+    fprintf(stderr, "ERROR: Failed to read indirect block!\n"); 
+    free(ptrs); 
+    return NULL; 
+  }
+  memcpy(ptrs, e->data, fs.block_size); 
+  pthread_mutex_unlock(&cache_lock); 
+  return ptrs; 
+}
+
+/*
+  Look up slot in a loaded pointer block. With alloc set an empty slot gets a new block and
+  the pointer block is marked dirty; owner is the inode a data block is allocated for, NULL
+  when the slot holds a pointer block.
+*/
+int imap_slot(uint32_t* ptrs, size_t slot, uint8_t* dirty, bool alloc, struct inode* owner){
+  if(ptrs[slot] == 0 && alloc){
+    int new_block = owner ? alloc_block(owner, 0) : get_free_block(); 
+    if(new_block == -1){
+      return -1; 
+    }
+    ptrs[slot] = new_block; 
+    *dirty = true; 
+  }
+  return ptrs[slot]; 
+}
+
+// hand a dirty pointer block over to the cache, which writes it back
+int imap_store(uint32_t ib, const uint32_t* ptrs){
+  pthread_mutex_lock(&cache_lock); 
+  struct cbuf* e = cache_get(ib, false); 
+  if(e == NULL){
+    pthread_mutex_unlock(&cache_lock); 
+    return -1; 
+  }
+  memcpy(e->data, ptrs, fs.block_size); 
+  e->uptodate = true; 
+  e->dirty = true; 
+  pthread_mutex_unlock(&cache_lock); 
+  return 0; 
+}
+
+int imap_flush(struct inode* inode){
+  struct imap* m = &imaps[inode_slot(inode)]; 
+
+  if(m->single_dirty){
+    if(imap_store(inode->map.blk.single_indirect, m->single) != 0){
+      return -1; 
+    }
+    m->single_dirty = false; 
+  }
+
+  if(m->dbl_dirty){
+    if(imap_store(inode->map.blk.double_indirect, m->dbl) != 0){
+      return -1; 
+    }
+    m->dbl_dirty = false; 
+  }
+
+  if(m->more_dirty){
+    if(imap_store(inode->map.ext.overflow, (uint32_t*) m->more) != 0){
+      return -1; 
+    }
+    m->more_dirty = false; 
+  }
+
+  for(size_t i = 0; m->leaves && i < fs.block_size / sizeof(uint32_t); i++){
+    if(m->leaf_dirty[i]){
+      if(imap_store(m->dbl[i], m->leaves[i]) != 0){
+        return -1; 
+      }
+      m->leaf_dirty[i] = false; 
+    }
+  }
+  return 0; 
+}
+
+// forget the block map; callers flush it first unless its pointer blocks are being freed
+void imap_release(struct inode* inode){
+  struct imap* m = &imaps[inode_slot(inode)]; 
+
+  for(size_t i = 0; m->leaves && i < fs.block_size / sizeof(uint32_t); i++){
+    free(m->leaves[i]); 
+  }
+  free(m->leaves); 
+  free(m->leaf_dirty); 
+  free(m->single); 
+  free(m->dbl); 
+  free(m->more); 
+  free(m->pend); 
+  memset(m, 0, sizeof(*m)); 
+}
+
+/*
+  The i'th extent of an EXTENTS inode, loading the overflow block the first time one past
+  NUM_EXTENTS is needed. NULL on failure.
+*/
+struct extent* ext_at(struct inode* inode, size_t i){
+  if(i < NUM_EXTENTS){
+    return &inode->map.ext.list[i]; 
+  }
+
+  struct imap* m = &imaps[inode_slot(inode)]; 
+  if(m->more == NULL && (m->more = (struct extent*) imap_load(inode->map.ext.overflow, false)) == NULL){
+    return NULL; 
+  }
+  return &m->more[i - NUM_EXTENTS]; 
+}
+
+void ext_dirty(struct inode* inode, size_t i){
+  if(i < NUM_EXTENTS){
+    inode->dirty = true; 
+  }
+  else{
+    imaps[inode_slot(inode)].more_dirty = true; 
+  }
+}
+
+/*
+  get_block for EXTENTS inodes. Files have no holes, so a block past the mapped ones can only
+  be the next one: it extends the last extent when the block right after it is free, and
+  starts a new extent otherwise.
+*/
+int ext_get_block(struct inode* inode, size_t block_idx, bool alloc){
+  struct imap* m = &imaps[inode_slot(inode)]; 
+  size_t count = inode->map.ext.count; 
+
+  // sequential access lands in the same extent as last time, start looking there
+  size_t i = 0, logical = 0; 
+  if(m->hint < count && block_idx >= m->hint_logical){
+    i = m->hint; 
+    logical = m->hint_logical; 
+  }
+  for(; i < count; i++){
+    struct extent* e = ext_at(inode, i); 
+    if(e == NULL){
+      return -1; 
+    }
+    if(block_idx < logical + e->len){
+      m->hint = i; 
+      m->hint_logical = logical; 
+      return e->start + (block_idx - logical); 
+    }
+    logical += e->len; 
+  }
+
+  if(!alloc){
+    return 0; 
+  }
+  if(block_idx != logical){
+    return -1; 
+  }
+
+  struct extent* last = NULL; 
+  if(count > 0 && (last = ext_at(inode, count - 1)) == NULL){
+    return -1; 
+  }
+  int new_block = alloc_block(inode, last ? last->start + last->len : 0); 
+  if(new_block == -1){
+    return -1; 
+  }
+  if(last != NULL && (uint32_t) new_block == last->start + last->len){
+    last->len++; 
+    ext_dirty(inode, count - 1); 
+    return new_block; 
+  }
+
+  if(count == NUM_EXTENTS + fs.block_size / sizeof(struct extent)){
+    // out of extents, as good as a full disk for this file
+    clear_bit(new_block); 
+    return -1; 
+  }
+
+  if(count == NUM_EXTENTS){
+    int overflow = get_free_block(); 
+    if(overflow == -1 || (m->more = (struct extent*) imap_load(overflow, true)) == NULL){
+      if(overflow != -1){
+        clear_bit(overflow); 
+      }
+      clear_bit(new_block); 
+      return -1; 
+    }
+    inode->map.ext.overflow = overflow; 
+  }
+
+  struct extent* e = ext_at(inode, count); 
+  if(e == NULL){
+    clear_bit(new_block); 
+    return -1; 
+  }
+  e->start = new_block; 
+  e->len = 1; 
+  ext_dirty(inode, count); 
+  inode->map.ext.count++; 
+  inode->dirty = true; 
+  return new_block; 
+}
+
+/*
+  Drop every block of an EXTENTS inode past the first keep ones, and the overflow block once
+  the extents that are left fit in the inode.
+*/
+int ext_truncate(struct inode* inode, size_t keep){
+  struct imap* m = &imaps[inode_slot(inode)]; 
+  size_t count = inode->map.ext.count; 
+  size_t logical = 0, left = 0; 
+
+  for(size_t i = 0; i < count; i++){
+    struct extent* e = ext_at(inode, i); 
+    if(e == NULL){
+      return -1; 
+    }
+
+    size_t cut = keep > logical ? keep - logical : 0; 
+    logical += e->len; 
+    if(cut >= e->len){
+      left = i + 1; 
+      continue; 
+    }
+
+    for(uint32_t b = e->start + cut; b < e->start + e->len; b++){
+      free_block(b); 
+    }
+    e->len = cut; 
+    ext_dirty(inode, i); 
+    if(cut > 0){
+      left = i + 1; 
+    }
+  }
+  inode->map.ext.count = left; 
+  inode->dirty = true; 
+
+  if(left <= NUM_EXTENTS && inode->map.ext.overflow != 0){
+    free_block(inode->map.ext.overflow); 
+    inode->map.ext.overflow = 0; 
+    free(m->more); 
+    m->more = NULL; 
+    m->more_dirty = false; 
+  }
+  m->hint = 0; 
+  m->hint_logical = 0; 
+  return 0; 
+}
+
+/*
+  Map the block_idx'th block of a file to its block on disk, walking the direct, single
+  and double indirect pointers through the inode's block map. With alloc set, missing data
+  and pointer blocks are allocated on the way. Returns 0 for a hole and -1 on failure (or a
+  full disk).
+*/
+int get_block(struct inode* inode, size_t block_idx, bool alloc){
+  size_t block_ptr = fs.block_size / sizeof(uint32_t); 
+  struct imap* m = &imaps[inode_slot(inode)]; 
+
+  if(inode->format == EXTENTS){
+    return ext_get_block(inode, block_idx, alloc); 
+  }
+
+  // direct blocks
+  if(block_idx < 10){
+    if(inode->map.blk.direct_offset[block_idx] == 0 && alloc){
+      int new_block = alloc_block(inode, 0); 
+      if(new_block == -1){
+        return -1; 
+      }
+      inode->map.blk.direct_offset[block_idx] = new_block; 
+      inode->dirty = true; 
+    }
+    return inode->map.blk.direct_offset[block_idx]; 
+  }
+  block_idx -= 10; 
+
+  // single indirect blocks
+  if(block_idx < block_ptr){
+    bool fresh = false; 
+    if(inode->map.blk.single_indirect == 0){
+      if(!alloc){
+        return 0; 
+      }
+      int new_block = get_free_block(); 
+      if(new_block == -1){
+        return -1; 
+      }
+      inode->map.blk.single_indirect = new_block; 
+      inode->dirty = true; 
+      fresh = true; 
+    }
+    if(m->single == NULL && (m->single = imap_load(inode->map.blk.single_indirect, fresh)) == NULL){
+      return -1; 
+    }
+    if(fresh){
+      m->single_dirty = true; 
+    }
+    return imap_slot(m->single, block_idx, &m->single_dirty, alloc, inode); 
+  }
+  block_idx -= block_ptr; 
+
+  // double indirect blocks
+  if(block_idx >= block_ptr * block_ptr){
+    return -1; 
+  }
+  bool fresh = false; 
+  if(inode->map.blk.double_indirect == 0){
+    if(!alloc){
+      return 0; 
+    }
+    int new_block = get_free_block(); 
+    if(new_block == -1){
+      return -1; 
+    }
+    inode->map.blk.double_indirect = new_block; 
+    inode->dirty = true; 
+    fresh = true; 
+  }
+  if(m->dbl == NULL){
+    m->dbl = imap_load(inode->map.blk.double_indirect, fresh); 
+    m->leaves = calloc(block_ptr, sizeof(uint32_t*)); 
+    m->leaf_dirty = calloc(block_ptr, sizeof(uint8_t)); 
+    if(m->dbl == NULL || m->leaves == NULL || m->leaf_dirty == NULL){
+      free(m->dbl); 
+      free(m->leaves); 
+      free(m->leaf_dirty); 
+      m->dbl = NULL; 
+      m->leaves = NULL; 
+      m->leaf_dirty = NULL; 
+      return -1; 
+    }
+  }
+  if(fresh){
+    m->dbl_dirty = true; 
+  }
+
+  size_t i = block_idx / block_ptr; 
+  fresh = m->dbl[i] == 0; 
+  int single_ib = imap_slot(m->dbl, i, &m->dbl_dirty, alloc, NULL); 
+  if(single_ib <= 0){
+    return single_ib; 
+  }
+  if(m->leaves[i] == NULL && (m->leaves[i] = imap_load(single_ib, fresh)) == NULL){
+    return -1; 
+  }
+  if(fresh){
+    m->leaf_dirty[i] = true; 
+  }
+  return imap_slot(m->leaves[i], block_idx % block_ptr, &m->leaf_dirty[i], alloc, inode); 
+}
+
+/*
+  Free the pointer block ib (0 for none) and everything below it: depth 1 is a single
+  indirect block of data block pointers, depth 2 a double indirect one.
+*/
+int free_indirect(uint32_t ib, int depth){
+  if(ib == 0){
+    return 0; 
+  }
+
+  // pinned, walking the level below goes through the cache too
+  struct cbuf* e; 
+  pthread_mutex_lock(&cache_lock); 
+  int got = cache_getv(&ib, 1, &e, true); 
+  pthread_mutex_unlock(&cache_lock); 
+  if(got != 0){
+    fprintf(stderr, "ERROR: Failed to read indirect block!\n"); 
+    return -1; 
+  }
+
+  uint32_t* ptrs = (uint32_t*) e->data; 
+  int ret = 0; 
+  for(size_t i = 0; i < fs.block_size / sizeof(uint32_t) && ret == 0; i++){
+    if(ptrs[i] == 0){
+      continue; 
+    }
+    if(depth > 1){
+      ret = free_indirect(ptrs[i], depth - 1); 
+    }
+    else{
+      free_block(ptrs[i]); 
+    }
+  }
+
+  pthread_mutex_lock(&cache_lock); 
+  cache_putv(&e, 1); 
+  pthread_mutex_unlock(&cache_lock); 
+  if(ret == 0){
+    free_block(ib); 
+  }
+  return ret; 
+}
+
+// free the data blocks in slots from on of a loaded pointer block
+void ptrs_free(uint32_t* ptrs, size_t from, uint8_t* dirty){
+  for(size_t i = from; i < fs.block_size / sizeof(uint32_t); i++){
+    if(ptrs[i] != 0){
+      free_block(ptrs[i]); 
+      ptrs[i] = 0; 
+      *dirty = true; 
+    }
+  }
+}
+
+/*
+  Free the blocks of a block-mapped file past its first keep blocks, keep past the direct
+  ones, in its loaded block map: the slots past keep are cleared and the pointer blocks left
+  with nothing in them are freed too.
+*/
+int blk_truncate(struct inode* inode, size_t keep){
+  size_t block_ptr = fs.block_size / sizeof(uint32_t); 
+  struct imap* m = &imaps[inode_slot(inode)]; 
+
+  // load the pointer blocks that keep - 1 goes through, and the double indirect one
+  if(get_block(inode, keep - 1, false) == -1 || 
+     (inode->map.blk.double_indirect != 0 && get_block(inode, 10 + block_ptr, false) == -1)){
+    return -1; 
+  }
+
+  size_t dkeep = 0; 
+  if(keep - 10 < block_ptr){
+    if(m->single != NULL){
+      ptrs_free(m->single, keep - 10, &m->single_dirty); 
+    }
+  }
+  else{
+    dkeep = keep - 10 - block_ptr; 
+  }
+  if(inode->map.blk.double_indirect == 0){
+    return 0; 
+  }
+
+  for(size_t i = 0; i < block_ptr; i++){
+    if(m->dbl[i] == 0 || (i + 1) * block_ptr <= dkeep){
+      continue; 
+    }
+    if(m->leaves[i] == NULL && (m->leaves[i] = imap_load(m->dbl[i], false)) == NULL){
+      return -1; 
+    }
+    size_t from = dkeep > i * block_ptr ? dkeep - i * block_ptr : 0; 
+    ptrs_free(m->leaves[i], from, &m->leaf_dirty[i]); 
+    if(from == 0){
+      free_block(m->dbl[i]); 
+      free(m->leaves[i]); 
+      m->leaves[i] = NULL; 
+      m->leaf_dirty[i] = false; 
+      m->dbl[i] = 0; 
+      m->dbl_dirty = true; 
+    }
+  }
+
+  if(dkeep == 0){
+    free_block(inode->map.blk.double_indirect); 
+    inode->map.blk.double_indirect = 0; 
+    free(m->dbl); 
+    free(m->leaves); 
+    free(m->leaf_dirty); 
+    m->dbl = NULL; 
+    m->leaves = NULL; 
+    m->leaf_dirty = NULL; 
+    m->dbl_dirty = false; 
+  }
+  return 0; 
+}
+
+/*
+  Free the data blocks of a file past its first keep blocks, and the pointer blocks that are
+  left with nothing to point at.
+*/
+int free_blocks(struct inode* inode, size_t keep){
+  if(inode->format == EXTENTS){
+    return ext_truncate(inode, keep); 
+  }
+
+  for(size_t i = keep; i < 10; i++){
+    if(inode->map.blk.direct_offset[i] != 0){
+      free_block(inode->map.blk.direct_offset[i]); 
+      inode->map.blk.direct_offset[i] = 0;
+    }
+  }
+
+  // pointer blocks are walked in the cache, which needs the block map's changes
+  if(keep <= 10){
+    if(imap_flush(inode) != 0){
+      return -1; 
+    }
+    imap_release(inode); 
+    if(free_indirect(inode->map.blk.single_indirect, 1) != 0 || free_indirect(inode->map.blk.double_indirect, 2) != 0){
+      return -1; 
+    }
+    inode->map.blk.single_indirect = 0; 
+    inode->map.blk.double_indirect = 0; 
+  }
+  else if(blk_truncate(inode, keep) != 0){
+    return -1; 
+  }
+  inode->dirty = true; 
+  return 0; 
+}
+
+/*
+Pending buffers: delayed allocation for fs_write
+  * New blocks at the end of a file are filled in a per-file buffer instead of the cache, and
+    get their disk blocks only when the buffer fills up, on fs_close, fs_truncate and in
+    write_back
+  * A flush allocates the whole buffer as one run and writes it with a single block_writev
+  * Every pending block, plus PEND_SLACK per buffer, is counted in ubm.reserved so a flush
+    always finds the blocks fs_write already said it had
+*/
+
+// give inode's pending blocks their disk blocks and write them out
+int pend_flush(struct inode* inode){
+  struct imap* m = &imaps[inode_slot(inode)]; 
+  size_t n = m->pend_count; 
+  if(n == 0){
+    return 0; 
+  }
+  pthread_mutex_lock(&bitmap_lock); 
+  ubm.reserved -= n + PEND_SLACK; 
+  pthread_mutex_unlock(&bitmap_lock); 
+  m->pend_count = 0; 
+
+  int blocks[IO_BATCH]; 
+  const void* bufs[IO_BATCH]; 
+  reserve_run(inode, n); 
+  for(size_t i = 0; i < n; i++){
+    int block = get_block(inode, m->pend_first + i, true); 
+    if(block <= 0){
+      fprintf(stderr, "ERROR: No free blocks are available!\n"); 
+      release_run(inode); 
+      return -1; 
+    }
+    blocks[i] = block; 
+    bufs[i] = m->pend + i * fs.block_size; 
+  }
+  release_run(inode); 
+
+  // the blocks go to the disk past the cache, which mustn't keep an older copy of them
+  pthread_mutex_lock(&cache_lock); 
+  for(size_t i = 0; i < n; i++){
+    cache_forget(blocks[i]); 
+  }
+  pthread_mutex_unlock(&cache_lock); 
+  if(disk_writev(dsk, n, blocks, bufs) != 0){
+    fprintf(stderr, "ERROR: Failed to write blocks!\n"); 
+    return -1; 
+  }
+  return 0; 
+}
+
+int pend_flush_all(){
+  for(size_t i = 0; imaps && i < fs.max_files; i++){
+    if(imaps[i].pend_count > 0 && pend_flush(&inodes[i]) != 0){
+      return -1; 
+    }
+  }
+  return 0; 
+}
+
+/*
+  Whether block_idx of inode, at or past its last allocated block, can be written in the
+  pending buffer. Blocks already there always can; a new one needs room in the buffer (a full
+  one is flushed first) and on the disk on top of everything already reserved, and is then
+  reserved too. 0 sends the write down the allocating path instead, -1 when a flush failed.
+*/
+int pend_room(struct inode* inode, size_t block_idx){
+  struct imap* m = &imaps[inode_slot(inode)]; 
+  if(m->pend_count && block_idx - m->pend_first < m->pend_count){
+    return 1; 
+  }
+  if(m->pend == NULL && (m->pend = alloc_blocks(IO_BATCH)) == NULL){
+    return 0; 
+  }
+  if(m->pend_count == IO_BATCH && pend_flush(inode) != 0){
+    return -1; 
+  }
+  size_t need = m->pend_count ? 1 : 1 + PEND_SLACK; 
+  pthread_mutex_lock(&bitmap_lock); 
+  bool room = ubm.nfree >= ubm.reserved + need; 
+  if(room){
+    ubm.reserved += need; 
+  }
+  pthread_mutex_unlock(&bitmap_lock); 
+  return room; 
+}
+
+// Management Routines
+
+// drop the tables mount_fs set up, all but root[]
+void tables_free(){
+  for(size_t i = 0; imaps && i < fs.max_files; i++){
+    imap_release(&inodes[i]); 
+  }
+  for(size_t i = 0; ilocks && i < fs.max_files; i++){
+    pthread_rwlock_destroy(&ilocks[i].rw); 
+    pthread_mutex_destroy(&ilocks[i].map); 
+  }
+  free(ilocks); 
+  ilocks = NULL; 
+  free(inodes); 
+  free(inode_loaded); 
+  free(open_count); 
+  free(imaps); 
+  free(fds); 
+  free(root); 
+  free(dir.slots); 
+  free(dir.dirty); 
+  inodes = NULL; 
+  inode_loaded = NULL; 
+  open_count = NULL; 
+  imaps = NULL; 
+  fds = NULL; 
+  root = NULL; 
+  nfds = 0; 
+  fd_hint = 0; 
+  memset(&dir, 0, sizeof(dir)); 
+}
+
+// read the whole directory into root[] with one block_readv
+int dir_load(){
+  size_t per_block = fs.block_size / sizeof(struct dentry); 
+  char* data = alloc_blocks(fs.dir_blocks); 
+  int* blocks = malloc(fs.dir_blocks * sizeof(int)); 
+  void** bufs = malloc(fs.dir_blocks * sizeof(void*)); 
+  int ret = 0; 
+
+  if(data == NULL || blocks == NULL || bufs == NULL){
+    fprintf(stderr, "ERROR: Failure to allocate directory buffer!\n"); 
+    ret = -1; 
+  }
+  else{
+    for(size_t i = 0; i < fs.dir_blocks; i++){
+      blocks[i] = fs.dir_offset + i; 
+      bufs[i] = data + i * fs.block_size; 
+    }
+    if(disk_readv(dsk, fs.dir_blocks, blocks, bufs) != 0){
+      fprintf(stderr, "ERROR: Failed to read directory!\n"); 
+      ret = -1; 
+    }
+  }
+
+  for(size_t i = 0; i < fs.dir_blocks && ret == 0; i++){
+    size_t count = fs.max_files - i * per_block < per_block ? fs.max_files - i * per_block : per_block; 
+    memcpy(root + i * per_block, data + i * fs.block_size, count * sizeof(struct dentry)); 
+  }
+
+  free(data); 
+  free(blocks); 
+  free(bufs); 
+  return ret; 
+}
+
+uint32_t journal_sum(const char* data, size_t len){
+  // FNV-1a
+  uint32_t h = 2166136261u; 
+  for(size_t i = 0; i < len; i++){
+    h = (h ^ (uint8_t) data[i]) * 16777619u; 
+  }
+  return h; 
+}
+
+void journal_free(){
+  free(journal.buf); 
+  free(journal.jblocks); 
+  free(journal.bufs); 
+  free(journal.blocks); 
+  free(journal.clean); 
+  free(journal.clean_arg); 
+  journal.buf = NULL; 
+  journal.jblocks = NULL; 
+  journal.bufs = NULL; 
+  journal.blocks = NULL; 
+  journal.clean = NULL; 
+  journal.clean_arg = NULL; 
+  journal.count = 0; 
+}
+
+// blocks of the superblock, bitmap, inode table and directory in fs: the most one transaction holds
+size_t journal_meta(){
+  return 1 + (size_t) fs.ub_bitmap_count + fs.im_blocks + fs.dir_blocks; 
+}
+
+// blocks of a jheader naming meta targets
+size_t journal_desc(size_t meta){
+  return (sizeof(struct jheader) + meta * sizeof(uint32_t) + fs.block_size - 1) / fs.block_size; 
+}
+
+/*
+  Set up the metadata batch for the file system in fs: room for every block of its tables, so
+  a write_back is always a single transaction.
+*/
+int journal_init(){
+  journal.cap = journal_meta(); 
+  journal.desc = journal_desc(journal.cap); 
+  journal.count = 0; 
+  journal.seq = 0; 
+  journal.used = false; 
+  journal.ops = 0; 
+
+  journal.buf = alloc_blocks(journal.desc + journal.cap); 
+  journal.jblocks = malloc((journal.desc + journal.cap) * sizeof(int)); 
+  journal.bufs = malloc((journal.desc + journal.cap) * sizeof(void*)); 
+  journal.blocks = malloc(journal.cap * sizeof(int)); 
+  journal.clean = malloc(journal.cap * sizeof(*journal.clean)); 
+  journal.clean_arg = malloc(journal.cap * sizeof(size_t)); 
+  if(journal.buf == NULL || journal.jblocks == NULL || journal.bufs == NULL || journal.blocks == NULL || 
+     journal.clean == NULL || journal.clean_arg == NULL){
+    fprintf(stderr, "ERROR: Failure to allocate the journal!\n"); 
+    journal_free(); 
+    return -1; 
+  }
+  for(size_t i = 0; i < journal.desc + journal.cap; i++){
+    journal.jblocks[i] = fs.journal_offset + i; 
+    journal.bufs[i] = journal.buf + i * fs.block_size; 
+  }
+  return 0; 
+}
+
+/*
+  Write the transaction left in the journal in place, if a whole one is there: a crash after
+  it was committed may have kept some of its blocks from getting there. The superblock in fs
+  is replaced if the transaction had one.
+*/
+int journal_replay(){
+  struct jheader* h = (struct jheader*) journal.buf; 
+
+  if(disk_read(dsk, fs.journal_offset, h) != 0){
+    fprintf(stderr, "ERROR: Failure to read the journal!\n"); 
+    return -1; 
+  }
+  // an empty journal, or a transaction a crash kept from being written whole
+  if(h->magic != JOURNAL_MAGIC || h->count == 0 || h->count > journal.cap){
+    return 0; 
+  }
+  if(disk_readv(dsk, journal.desc - 1 + h->count, journal.jblocks + 1, journal.bufs + 1) != 0){
+    fprintf(stderr, "ERROR: Failure to read the journal!\n"); 
+    return -1; 
+  }
+  uint32_t sum = h->sum; 
+  h->sum = 0; 
+  if(journal_sum(journal.buf, (journal.desc + h->count) * (size_t) fs.block_size) != sum){
+    return 0; 
+  }
+
+  // metadata lives in front of the journal
+  for(size_t i = 0; i < h->count; i++){
+    if(h->targets[i] >= fs.journal_offset){
+      fprintf(stderr, "ERROR: Journal is corrupt!\n"); 
+      return -1; 
+    }
+    journal.blocks[i] = h->targets[i]; 
+  }
+  if(disk_writev(dsk, h->count, journal.blocks, (const void* const*) journal.bufs + journal.desc) != 0 || 
+     disk_sync(dsk) != 0){
+    fprintf(stderr, "ERROR: Failure to replay the journal!\n"); 
+    return -1; 
+  }
+  for(size_t i = 0; i < h->count; i++){
+    if(h->targets[i] == 0){
+      memcpy(&fs, journal.bufs[journal.desc + i], sizeof(fs)); 
+    }
+  }
+  journal.seq = h->seq; 
+
+  // it is in place now, don't do it again at the next mount
+  memset(h, 0, fs.block_size); 
+  if(disk_write(dsk, fs.journal_offset, h) != 0){
+    fprintf(stderr, "ERROR: Failure to write the journal!\n"); 
+    return -1; 
+  }
+  return 0; 
+}
+
+/*
+  Commit the batch: to the journal first, then in place. The data the
+  batch refers to and the blocks of the last commit are made durable before the new
+  transaction overwrites the journal.
+*/
+int meta_commit(){
+  struct jheader* h = (struct jheader*) journal.buf; 
+  size_t n = journal.count; 
+
+  if(n == 0){
+    return 0; 
+  }
+
+  memset(h, 0, journal.desc * fs.block_size); 
+  h->magic = JOURNAL_MAGIC; 
+  h->seq = ++journal.seq; 
+  h->count = n; 
+  for(size_t i = 0; i < n; i++){
+    h->targets[i] = journal.blocks[i]; 
+  }
+  h->sum = journal_sum(journal.buf, (journal.desc + n) * fs.block_size); 
+
+  if(disk_sync(dsk) != 0 || 
+     disk_writev(dsk, journal.desc + n, journal.jblocks, (const void* const*) journal.bufs) != 0 || 
+     disk_sync(dsk) != 0){
+    fprintf(stderr, "ERROR: Failure to write the journal!\n"); 
+    return -1; 
+  }
+  journal.used = true; 
+  bitmap_release(); 
 
-struct superblock fs; 
-struct bitmap_info ubm; 
-struct dentry root[MAX_FILES]; 
-struct FD fds[MAX_FILDES]; 
-struct inode inodes[MAX_FILES]; 
+  if(disk_writev(dsk, n, journal.blocks, (const void* const*) journal.bufs + journal.desc) != 0){
+    fprintf(stderr, "ERROR: Failure to write back metadata!\n"); 
+    return -1; 
+  }
+  for(size_t i = 0; i < n; i++){
+    journal.clean[i](journal.clean_arg[i]); 
+  }
+  journal.count = 0; 
+  return 0; 
+}
 
-bool mounted = false; 
+// the buffer for the next block of the batch, which has room for all of the tables
+char* journal_slot(){
+  return journal.bufs[journal.desc + journal.count]; 
+}
+
+// add the block built in journal_slot() to the batch, to go to block with clean(arg) after
+void journal_add(uint32_t block, void (*clean)(size_t), size_t arg){
+  journal.blocks[journal.count] = block; 
+  journal.clean[journal.count] = clean; 
+  journal.clean_arg[journal.count] = arg; 
+  journal.count++; 
+}
 
 /*
-  BITMAP hints: 
-    * 1 bit per block indicating if it's free or not
-    * All of the bits get combined into one long series of bits and written to a location on disk 
-    * biggest data tpye we have is 64 bits, but we need ~8192
-    * Solution: use an array: used_block_bitmap[DISK_BLOCKS / CHAR_BIT]
-    * Write helper functions to perform single bit operations 
-      * get, set, clear
-      * (/), (%), (&) will help!  
+  Add the blocks of an on-disk table that changed to the metadata batch.
+  fill(i, buf) builds block i of the table in buf and returns false when it is unchanged;
+  clean(i) is called once block i is on disk.
 */
+void table_flush(uint32_t offset, size_t nblocks, bool (*fill)(size_t, char*), void (*clean)(size_t)){
+  for(size_t i = 0; i < nblocks; i++){
+    char* buf = journal_slot(); 
+    memset(buf, 0, fs.block_size); 
+    if(fill(i, buf)){
+      journal_add(offset + i, clean, i); 
+    }
+  }
+}
 
-void initialize_fs_structs() {
-    // Initialize the superblock
-    fs.ub_bitmap_count = 0;
-    fs.ub_bitmap_offset = 0;
-    fs.im_blocks = 0;
-    fs.im_offset = 0;
-    fs.dirty = false;
+bool super_fill(size_t i, char* buf){
+  if(!fs.dirty){
+    return false; 
+  }
+  memcpy(buf, &fs, sizeof(fs)); 
+  ((struct superblock*) buf)->dirty = false; 
+  return true; 
+}
 
-    memset(ubm.ub_bitmap, 0, sizeof(ubm.ub_bitmap));
-    
-    ubm.dirty = false;
+void super_clean(size_t i){
+  fs.dirty = false; 
+}
 
-    for (int i = 0; i < MAX_FILES; i++) {
-        memset(root[i].name, 0, MAX_FNAME_SIZE); 
-        root[i].is_used = false;
-        root[i].inode_num = i; 
-    }
+// the bitmap has a single dirty flag, so all of it is written once any of it changed
+bool bitmap_fill(size_t i, char* buf){
+  if(!ubm.dirty){
+    return false; 
+  }
+  uint64_t* words = (uint64_t*) buf; 
+  size_t first = i * fs.block_size / sizeof(uint64_t); 
+  for(size_t w = 0; w < fs.block_size / sizeof(uint64_t); w++){
+    words[w] = ubm.ub_bitmap[first + w] & ~ubm.held[first + w]; 
+  }
+  return true; 
+}
 
-    for (int i = 0; i < MAX_FILES; i++) {
-        inodes[i].type = NOTHING; 
-        inodes[i].size = 0;
-        memset(inodes[i].direct_offset, 0, sizeof(inodes[i].direct_offset));
-        inodes[i].single_indirect = 0;
-        inodes[i].double_indirect = 0;
-        inodes[i].is_used = false;
-        inodes[i].inode_num = i; 
-        inodes[i].dirty = false;
-    }
+void bitmap_clean(size_t i){
+  if(i == fs.ub_bitmap_count - 1){
+    ubm.dirty = false; 
+  }
+}
 
-    for (int i = 0; i < MAX_FILDES; i++) {
-        fds[i].is_used = false;
-        fds[i].inode_num = 0; 
-        fds[i].offset = 0; 
-    }
+bool dir_fill(size_t i, char* buf){
+  size_t per_block = fs.block_size / sizeof(struct dentry); 
+  if(!dir.dirty[i]){
+    return false; 
+  }
+  size_t count = fs.max_files - i * per_block < per_block ? fs.max_files - i * per_block : per_block; 
+  memcpy(buf, root + i * per_block, count * sizeof(struct dentry)); 
+  return true; 
 }
 
+void dir_clean(size_t i){
+  dir.dirty[i] = false; 
+}
 
-void set_bit(int block_num){
-  uint16_t index = block_num / 8; 
-  uint16_t pos = block_num % 8; 
-  ubm.ub_bitmap[index] |= (1  << pos); 
-  ubm.dirty = true; 
+// an inode table block is written whole, from the in-memory inodes, once any of them changed
+bool inode_fill(size_t i, char* buf){
+  size_t per_block = fs.block_size / sizeof(struct inode); 
+  size_t first = i * per_block; 
+  size_t count = fs.max_files - first < per_block ? fs.max_files - first : per_block; 
+  bool dirty = false; 
+
+  // only the blocks that were read in can have changed
+  if(!inode_loaded[i]){
+    return false; 
+  }
+  for(size_t j = first; j < first + count; j++){
+    dirty = dirty || inodes[j].dirty; 
+  }
+  if(!dirty){
+    return false; 
+  }
+
+  memcpy(buf, inodes + first, count * sizeof(struct inode)); 
+  for(size_t j = 0; j < count; j++){
+    ((struct inode*) buf)[j].dirty = false; 
+  }
+  return true; 
 }
 
-int get_bit(int block_num){
-  uint16_t index = block_num / 8; 
-  uint16_t pos = block_num % 8; 
-  return (ubm.ub_bitmap[index] & (1  << pos)) != 0; 
+void inode_clean(size_t i){
+  size_t per_block = fs.block_size / sizeof(struct inode); 
+  for(size_t j = i * per_block; j < (i + 1) * per_block && j < fs.max_files; j++){
+    inodes[j].dirty = false; 
+  }
 }
 
-void clear_bit(int block_num){
-  uint16_t index = block_num / 8; 
-  uint16_t pos = block_num % 8; 
-  ubm.ub_bitmap[index] &= ~(1  << pos); 
-  fs.ub_bitmap_count--; 
+/*
+  Set up the in-memory tables for the file system in fs: all inodes unread, no descriptors,
+  and root[] read from the disk.
+*/
+int tables_init(){
+  inodes = calloc(fs.max_files, sizeof(struct inode)); 
+  inode_loaded = calloc(fs.im_blocks, sizeof(uint8_t)); 
+  open_count = calloc(fs.max_files, sizeof(uint32_t)); 
+  imaps = calloc(fs.max_files, sizeof(struct imap)); 
+  root = calloc(fs.max_files, sizeof(struct dentry)); 
+  dir.dirty = calloc(fs.dir_blocks + 1, sizeof(uint8_t)); 
+
+  if(inodes == NULL || inode_loaded == NULL || open_count == NULL || imaps == NULL || root == NULL || dir.dirty == NULL){
+    fprintf(stderr, "ERROR: Failure to allocate file tables!\n"); 
+    tables_free(); 
+    return -1; 
+  }
+  if((ilocks = malloc(fs.max_files * sizeof(struct ilock))) == NULL){
+    fprintf(stderr, "ERROR: Failure to allocate file tables!\n"); 
+    tables_free(); 
+    return -1; 
+  }
+  for(size_t i = 0; i < fs.max_files; i++){
+    pthread_rwlock_init(&ilocks[i].rw, NULL); 
+    pthread_mutex_init(&ilocks[i].map, NULL); 
+  }
+  if(dir_load() != 0 || dir_rebuild() != 0){
+    tables_free(); 
+    return -1; 
+  }
+  for(size_t i = 0; i < fs.max_files; i++){
+    inodes[i].inode_num = i; 
+  }
+  return 0; 
 }
 
-int get_free_block(){
-  for(int i = 0; i < DISK_BLOCKS; i++){
-    if(get_bit(i) == 0){
-      // a free block was found
-      set_bit(i); 
-      fs.ub_bitmap_count++; 
-      return i; 
+/*
+  Inode i, reading in its block of the inode table the first time any inode in it is needed.
+  NULL on failure.
+*/
+struct inode* inode_get(size_t i){
+  size_t per_block = fs.block_size / sizeof(struct inode); 
+  size_t blk = i / per_block; 
+
+  if(!inode_loaded[blk]){
+    char* buffer = disk_buf_get(dsk); 
+    if(buffer == NULL || disk_read(dsk, fs.im_offset + blk, buffer) != 0){
+      fprintf(stderr, "ERROR: Failed to read inode table!\n"); 
+      disk_buf_put(dsk, buffer); 
+      return NULL; 
     }
-  }
 
-  // no free block was found!
-  return -1; 
+    // the last block of the table may only be partly used
+    size_t first = blk * per_block; 
+    size_t count = fs.max_files - first < per_block ? fs.max_files - first : per_block; 
+    memcpy(inodes + first, buffer, count * sizeof(struct inode)); 
+    disk_buf_put(dsk, buffer); 
+
+    // inode_num indexes the in-memory tables, trust the position over what is on disk
+    for(size_t j = first; j < first + count; j++){
+      inodes[j].inode_num = j; 
+      inodes[j].dirty = false; 
+    }
+    inode_loaded[blk] = true; 
+  }
+  return &inodes[i]; 
 }
 
-// Management Routines
+int format_fs(const char* disk_name, int blocks, int block_size, int flags, int files); 
 
 int make_fs(const char* disk_name){
+  return format_fs(disk_name, DISK_BLOCKS, BLOCK_SIZE, 0, MAX_FILES); 
+}
+
+int make_fs_geometry(const char* disk_name, int blocks, int block_size){
+  return format_fs(disk_name, blocks, block_size, 0, MAX_FILES); 
+}
+
+int make_fs_flags(const char* disk_name, int flags){
+  return format_fs(disk_name, DISK_BLOCKS, BLOCK_SIZE, flags, MAX_FILES); 
+}
+
+int make_fs_files(const char* disk_name, int files){
+  return format_fs(disk_name, DISK_BLOCKS, BLOCK_SIZE, 0, files); 
+}
+
+int format_fs(const char* disk_name, int blocks, int block_size, int flags, int files){
   
   /*
   This function creates a fresh (and empty) file system on the virtual disk with name disk_name.
@@ -200,69 +2042,330 @@ int make_fs(const char* disk_name){
   Then, open this disk and write/initialize the necessary meta-information for your file system so
   that it can be later used (mounted). The function returns 0 on success, and -1 if the disk
   disk_name could not be created, opened, or properly initialized.
+
+  The disk gets blocks blocks of block_size bytes; make_fs uses the defaults from disk.h.
+  flags are FS_* options, e.g. FS_EXTENTS to map new files with extents.
   */
   
-  if(make_disk(disk_name) != 0){
+  if(mounted){
+    fprintf(stderr, "ERROR: A disk is already mounted!\n"); 
+    return -1; 
+  }
+
+  if(files < 1 || files > FILES_LIMIT){
+    fprintf(stderr, "ERROR: A file system holds between 1 and %d files!\n", FILES_LIMIT); 
+    return -1; 
+  }
+
+  if(make_disk_geometry(disk_name, blocks, block_size, 0) != 0){
     fprintf(stderr, "ERROR: Failure to create disk!\n"); 
     return -1; 
   }
 
-  if(open_disk(disk_name) != 0){
+  if((dsk = disk_open(disk_name, 0)) == NULL){
     fprintf(stderr, "ERROR: Failure to open disk!\n"); 
     return -1;
   }
 
   initialize_fs_structs(); 
 
+  fs.magic = FS_MAGIC; 
+  fs.flags = flags; 
+  fs.max_files = files; 
+  fs.block_size = disk_block_size(dsk); 
+  fs.disk_blocks = disk_blocks(dsk); 
   // blocks needed for bitmap
-  fs.ub_bitmap_count = (DISK_BLOCKS / 8 + MAX_BLOCK_SIZE - 1) / MAX_BLOCK_SIZE;
+  fs.ub_bitmap_count = (fs.disk_blocks / 8 + fs.block_size - 1) / fs.block_size;
   // bitmap starts right after superblock
   fs.ub_bitmap_offset = 1;
-  // total size for all inodes in bytes and determine blocks needed 
-  size_t total_inode_size = sizeof(struct inode) * MAX_FILES; 
-  fs.im_blocks = (total_inode_size + MAX_BLOCK_SIZE - 1) / MAX_BLOCK_SIZE; 
+  // blocks needed for all inodes, an inode never straddles two blocks
+  size_t inodes_per_block = fs.block_size / sizeof(struct inode); 
+  fs.im_blocks = (fs.max_files + inodes_per_block - 1) / inodes_per_block; 
   // inode metadata start offset
   fs.im_offset = fs.ub_bitmap_count + fs.ub_bitmap_offset;  
+  // directory entries after the inodes, none of them straddling two blocks either
+  size_t dentries_per_block = fs.block_size / sizeof(struct dentry); 
+  fs.dir_blocks = (fs.max_files + dentries_per_block - 1) / dentries_per_block; 
+  fs.dir_offset = fs.im_offset + fs.im_blocks; 
+  // the journal after that: the header, then room for every block of the tables above
+  fs.journal_blocks = journal_desc(journal_meta()) + journal_meta(); 
+  fs.journal_offset = fs.dir_offset + fs.dir_blocks; 
+
+  if(fs.journal_offset + fs.journal_blocks >= fs.disk_blocks){
+    fprintf(stderr, "ERROR: Disk is too small for a file system!\n"); 
+    disk_close(dsk); 
+    dsk = NULL; 
+    return -1; 
+  }
+
+  ubm.ub_bitmap = alloc_blocks(fs.ub_bitmap_count); 
+  char* buffer = disk_buf_get(dsk); 
+  if(ubm.ub_bitmap == NULL || buffer == NULL){
+    fprintf(stderr, "ERROR: Failure to allocate bitmap!\n"); 
+    free(ubm.ub_bitmap); 
+    ubm.ub_bitmap = NULL; 
+    disk_buf_put(dsk, buffer); 
+    disk_close(dsk); 
+    dsk = NULL; 
+    return -1; 
+  }
+  memset(ubm.ub_bitmap, 0, (size_t)fs.ub_bitmap_count * fs.block_size); 
+  bitmap_init(); 
+
+  int ret = 0; 
 
   // store the data needed for the disk
-  char buffer[MAX_BLOCK_SIZE]; 
-  memset(buffer, 0, MAX_BLOCK_SIZE); 
+  memset(buffer, 0, fs.block_size); 
   memcpy(buffer, &fs, sizeof(fs)); 
-  if(block_write(0, buffer) != 0){
+  if(disk_write(dsk, 0, buffer) != 0){
     fprintf(stderr, "ERROR: Failure to write!\n"); 
-    close_disk(); 
-    return -1; 
+    ret = -1; 
   }
   
-  memset(buffer, 0, MAX_BLOCK_SIZE); 
-  for(int i = 0; i < fs.im_offset + fs.im_blocks; i++){
+  for(int i = 0; i < fs.journal_offset + fs.journal_blocks; i++){
     set_bit(i); 
   }
   
-  if(block_write(fs.ub_bitmap_offset, ubm.ub_bitmap) != 0){
-    fprintf(stderr, "ERROR: Failure to write bitmap!\n"); 
-    close_disk(); 
-    return -1; 
+  for(int i = 0; i < fs.ub_bitmap_count && ret == 0; i++){
+    if(disk_write(dsk, fs.ub_bitmap_offset + i, (char*) ubm.ub_bitmap + i * fs.block_size) != 0){
+      fprintf(stderr, "ERROR: Failure to write bitmap!\n"); 
+      ret = -1; 
+    }
   }
 
-  memset(buffer, 0, MAX_BLOCK_SIZE); 
-  for(int i = 0; i < fs.im_blocks; i++){
-    if(block_write(fs.im_offset + i, buffer) != 0){
+  memset(buffer, 0, fs.block_size); 
+  for(int i = 0; i < fs.im_blocks && ret == 0; i++){
+    if(disk_write(dsk, fs.im_offset + i, buffer) != 0){
       fprintf(stderr, "ERROR: Failure to write in inode table");
-      close_disk(); 
-      return -1; 
+      ret = -1; 
+    }
+  }
+  for(int i = 0; i < fs.dir_blocks && ret == 0; i++){
+    if(disk_write(dsk, fs.dir_offset + i, buffer) != 0){
+      fprintf(stderr, "ERROR: Failure to write the directory!\n");
+      ret = -1; 
     }
   }
+  // an empty journal
+  if(ret == 0 && disk_write(dsk, fs.journal_offset, buffer) != 0){
+    fprintf(stderr, "ERROR: Failure to write the journal!\n");
+    ret = -1; 
+  }
+
+  free(ubm.ub_bitmap); 
+  ubm.ub_bitmap = NULL; 
+  disk_buf_put(dsk, buffer); 
 
-  if(close_disk() != 0){
+  int closed = disk_close(dsk); 
+  dsk = NULL; 
+  if(closed != 0){
     fprintf(stderr, "ERROR: Failure to close disk!\n"); 
     return -1; 
   }
 
-  return 0;
+  return ret;
+}
+
+/*
+  Write everything that is only in memory back to the disk: dirty cached blocks, then the
+  superblock, bitmap, inodes and directory as one transaction.
+*/
+int write_back(){
+  /* I will write back if any structure is considered dirty */
+
+  // pending data gets its blocks first, that changes the block maps and the bitmap
+  if(pend_flush_all() != 0){
+    return -1; 
+  }
+
+  // block maps, then the cached blocks they went into
+  for(size_t i = 0; i < fs.max_files; i++){
+    if(inodes[i].is_used && imap_flush(&inodes[i]) != 0){
+      return -1; 
+    }
+  }
+  if(cache_writeback() != 0){
+    return -1; 
+  }
+
+  // super block, bit map, inodes a block of the table at a time, then the directory
+  table_flush(0, 1, super_fill, super_clean); 
+  table_flush(fs.ub_bitmap_offset, fs.ub_bitmap_count, bitmap_fill, bitmap_clean); 
+  table_flush(fs.im_offset, fs.im_blocks, inode_fill, inode_clean); 
+  table_flush(fs.dir_offset, fs.dir_blocks, dir_fill, dir_clean); 
+  if(meta_commit() != 0){
+    fprintf(stderr, "ERROR: Failure to write back the file system tables!\n"); 
+    journal.count = 0; 
+    return -1; 
+  }
+  // the commit thread reads it without dir_lock
+  __atomic_store_n(&journal.ops, 0, __ATOMIC_RELAXED); 
+  return 0; 
+}
+
+/*
+  Commit thread: every JOURNAL_MS, write back what the calls since the last write_back
+  changed, so a crash loses at most that much and the calls in between share one commit.
+*/
+void* journal_thread(void* arg){
+  pthread_mutex_lock(&journal.lock); 
+  while(!journal.stop){
+    struct timespec until; 
+    clock_gettime(CLOCK_REALTIME, &until); 
+    until.tv_sec += JOURNAL_MS / 1000; 
+    until.tv_nsec += (JOURNAL_MS % 1000) * 1000000L; 
+    if(until.tv_nsec >= 1000000000L){
+      until.tv_sec++; 
+      until.tv_nsec -= 1000000000L; 
+    }
+    pthread_cond_timedwait(&journal.wake, &journal.lock, &until); 
+    if(journal.stop || __atomic_load_n(&journal.ops, __ATOMIC_RELAXED) == 0){
+      continue; 
+    }
+
+    pthread_mutex_unlock(&journal.lock); 
+    pthread_rwlock_wrlock(&dir_lock); 
+    if(mounted && __atomic_load_n(&journal.ops, __ATOMIC_RELAXED) != 0){
+      write_back(); 
+    }
+    pthread_rwlock_unlock(&dir_lock); 
+    pthread_mutex_lock(&journal.lock); 
+  }
+  pthread_mutex_unlock(&journal.lock); 
+  return NULL; 
+}
+
+void journal_start(){
+  pthread_mutex_lock(&journal.lock); 
+  if(!journal.running){
+    journal.stop = false; 
+    journal.running = pthread_create(&journal.thread, NULL, journal_thread, NULL) == 0; 
+  }
+  pthread_mutex_unlock(&journal.lock); 
+}
+
+void journal_stop(){
+  pthread_mutex_lock(&journal.lock); 
+  bool running = journal.running; 
+  journal.stop = true; 
+  journal.running = false; 
+  pthread_cond_signal(&journal.wake); 
+  pthread_mutex_unlock(&journal.lock); 
+  if(running){
+    pthread_join(journal.thread, NULL); 
+  }
+}
+
+// a call changed something write_back has to write; callers may share dir_lock
+void journal_note(){
+  __atomic_fetch_add(&journal.ops, 1, __ATOMIC_RELAXED); 
+}
+
+/*
+  Commit now if blocks freed since the last commit are held back, so that they can be handed
+  out again; false when none are. For a write that ran out of room, called with nothing held.
+*/
+bool commit_held(){
+  pthread_rwlock_rdlock(&dir_lock); 
+  pthread_mutex_lock(&bitmap_lock); 
+  bool held = mounted && ubm.nheld != 0; 
+  pthread_mutex_unlock(&bitmap_lock); 
+  pthread_rwlock_unlock(&dir_lock); 
+  if(!held){
+    return false; 
+  }
+
+  pthread_rwlock_wrlock(&dir_lock); 
+  if(mounted){
+    write_back(); 
+  }
+  pthread_rwlock_unlock(&dir_lock); 
+  return true; 
+}
+
+int fs_sync(){
+  pthread_rwlock_wrlock(&dir_lock); 
+  int ret = -1; 
+  if(!mounted){
+    fprintf(stderr, "ERROR: Disk isn't mounted!\n"); 
+  }
+  else{
+    ret = write_back(); 
+  }
+  pthread_rwlock_unlock(&dir_lock); 
+  return ret; 
+}
+
+int cache_resize(size_t blocks){
+  if(blocks < CACHE_MIN){
+    fprintf(stderr, "ERROR: Block cache needs at least %d blocks!\n", CACHE_MIN); 
+    return -1; 
+  }
+
+  if(!mounted){
+    cache.capacity = blocks; 
+    return 0; 
+  }
+
+  // a mounted file system gets the new cache right away, or keeps a cache of the old size
+  size_t old = cache.capacity; 
+  if(cache_writeback() != 0){
+    return -1; 
+  }
+  cache_free(); 
+  cache.capacity = blocks; 
+  if(cache_init() != 0){
+    cache.capacity = old; 
+    cache_init(); 
+    return -1; 
+  }
+  return 0; 
+}
+
+int fs_cache_size(size_t blocks){
+  pthread_rwlock_wrlock(&dir_lock); 
+  int ret = cache_resize(blocks); 
+  pthread_rwlock_unlock(&dir_lock); 
+  return ret; 
+}
+
+int fd_table_limit(size_t n){
+  if(n == 0){
+    fprintf(stderr, "ERROR: At least one file descriptor has to be allowed!\n"); 
+    return -1; 
+  }
+
+  // descriptors that are open keep their numbers, the table only shrinks past the last of them
+  if(n < nfds){
+    for(size_t i = n; i < nfds; i++){
+      if(fds[i].is_used){
+        fprintf(stderr, "ERROR: File descriptor %zu is still open!\n", i); 
+        return -1; 
+      }
+    }
+    struct FD* table = realloc(fds, n * sizeof(struct FD)); 
+    if(table != NULL){
+      fds = table; 
+    }
+    nfds = n; 
+    fd_hint = 0; 
+  }
+  fd_limit = n; 
+  return 0; 
+}
+
+int fs_fd_limit(size_t n){
+  pthread_rwlock_wrlock(&dir_lock); 
+  int ret = fd_table_limit(n); 
+  pthread_rwlock_unlock(&dir_lock); 
+  return ret; 
 }
 
 int mount_fs(const char *disk_name){
+  return mount_fs_flags(disk_name, 0); 
+}
+
+int mount_disk(const char *disk_name, int flags){
 
   /*
   This function mounts a file system that is stored on a virtual disk with name disk_name. With
@@ -271,48 +2374,112 @@ int mount_fs(const char *disk_name){
   discussed below. The function returns 0 on success, and -1 when the disk disk_name could not
   be opened or when the disk does not contain a valid file system (that you previously created
   with make_fs).
+
+  flags are passed through to disk_open to pick the disk backend (e.g. DISK_MMAP).
   */
 
-  if(open_disk(disk_name) != 0){
+  if(mounted){
+    fprintf(stderr, "ERROR: A disk is already mounted!\n"); 
+    return -1; 
+  }
+
+  if((dsk = disk_open(disk_name, flags)) == NULL){
     fprintf(stderr, "ERROR: Failure to open disk!\n"); 
     return -1; 
   }
+  // io_uring still goes through the page cache, and DISK_DIRECT may have fallen back to it
+  readahead = (disk_mode(dsk) & DISK_DIRECT) != 0; 
 
-  char buffer[MAX_BLOCK_SIZE];
-  if(block_read(0, buffer) != 0){
+  char* buffer = disk_buf_get(dsk);
+  if(buffer == NULL || disk_read(dsk, 0, buffer) != 0){
     fprintf(stderr, "ERROR: Failure to read super block!\n");
-    close_disk();
+    disk_buf_put(dsk, buffer); 
+    disk_close(dsk); 
+    dsk = NULL;
     return -1;
   }
   memcpy(&fs, buffer, sizeof(fs)); 
 
-  for(int i = 0; i < fs.ub_bitmap_count; i++){
-    if(block_read(fs.ub_bitmap_offset + i, buffer) != 0){
+  // the superblock has to describe the disk it sits on, and every table make_fs lays out
+  if(fs.magic != FS_MAGIC || fs.block_size != disk_block_size(dsk) || fs.disk_blocks != disk_blocks(dsk) || 
+     fs.max_files == 0 || fs.max_files > FILES_LIMIT || 
+     (size_t) fs.im_blocks * (fs.block_size / sizeof(struct inode)) < fs.max_files || 
+     (size_t) fs.dir_blocks * (fs.block_size / sizeof(struct dentry)) < fs.max_files || 
+     fs.journal_blocks < journal_desc(journal_meta()) + journal_meta() || 
+     fs.journal_offset < fs.dir_offset + fs.dir_blocks || 
+     (size_t) fs.journal_offset + fs.journal_blocks > fs.disk_blocks){
+    fprintf(stderr, "ERROR: Disk doesn't hold a valid file system!\n"); 
+    disk_buf_put(dsk, buffer); 
+    disk_close(dsk); 
+    dsk = NULL; 
+    return -1; 
+  }
+
+  // finish the writes of a commit a crash interrupted before reading any of the metadata
+  if(journal_init() != 0 || journal_replay() != 0){
+    journal_free(); 
+    disk_buf_put(dsk, buffer); 
+    disk_close(dsk); 
+    dsk = NULL; 
+    return -1; 
+  }
+
+  ubm.ub_bitmap = alloc_blocks(fs.ub_bitmap_count); 
+  if(ubm.ub_bitmap == NULL){
+    fprintf(stderr, "ERROR: Failure to allocate bitmap!\n"); 
+    journal_free(); 
+    disk_buf_put(dsk, buffer); 
+    disk_close(dsk); 
+    dsk = NULL; 
+    return -1; 
+  }
+
+  int ret = 0; 
+  for(int i = 0; i < fs.ub_bitmap_count && ret == 0; i++){
+    if(disk_read(dsk, fs.ub_bitmap_offset + i, (char*) ubm.ub_bitmap + i * fs.block_size) != 0){
       fprintf(stderr, "ERROR: Failure to read bitmap block!\n"); 
-      close_disk(); 
-      return -1; 
+      ret = -1; 
     }  
-    memcpy(ubm.ub_bitmap + i * MAX_BLOCK_SIZE, buffer, MAX_BLOCK_SIZE); 
   }
-
-  for(int i = 0; i < fs.im_blocks; i++){
-    if(block_read(fs.im_offset + i, buffer) != 0){
-      fprintf(stderr, "ERROR: Failed to read inode table!\n"); 
-      close_disk(); 
-      return -1; 
+  if(ret == 0){
+    bitmap_init(); 
+    if((ubm.held = calloc(ubm.nwords, sizeof(uint64_t))) == NULL){
+      fprintf(stderr, "ERROR: Failure to allocate bitmap!\n"); 
+      ret = -1; 
     }
+  }
 
-    size_t cpy_size = (i == fs.im_blocks - 1) ? 
-    (MAX_FILES % (MAX_BLOCK_SIZE / sizeof(struct inode))) * sizeof(struct inode) : MAX_BLOCK_SIZE;
-
-    memcpy(inodes + i * (MAX_BLOCK_SIZE / sizeof(struct inode)), buffer, cpy_size); 
+  // the inode table itself is read as it is used
+  disk_buf_put(dsk, buffer); 
+  if(ret == 0 && (ret = tables_init()) == 0 && (ret = cache_init()) != 0){
+    tables_free(); 
+  }
+  if(ret != 0){
+    free(ubm.ub_bitmap); 
+    free(ubm.held); 
+    ubm.ub_bitmap = NULL; 
+    ubm.held = NULL; 
+    journal_free(); 
+    disk_close(dsk); 
+    dsk = NULL; 
+    return -1; 
   }
 
   mounted = true; 
   return 0; 
 }
 
-int umount_fs(const char *disk_name) {
+int mount_fs_flags(const char *disk_name, int flags){
+  pthread_rwlock_wrlock(&dir_lock); 
+  int ret = mount_disk(disk_name, flags); 
+  pthread_rwlock_unlock(&dir_lock); 
+  if(ret == 0){
+    journal_start(); 
+  }
+  return ret; 
+}
+
+int umount_disk(const char *disk_name) {
   
   /*
   This function unmounts your file system from a virtual disk with name disk_name. As part of
@@ -337,67 +2504,60 @@ int umount_fs(const char *disk_name) {
     return -1; 
   }
 
-  char buffer[MAX_BLOCK_SIZE]; 
-
-  /* I will write back if any structure is considered dirty */
-  
-  // super block
-  if(fs.dirty){
-    memset(buffer, 0, MAX_BLOCK_SIZE); 
-    memcpy(buffer, &fs, sizeof(fs)); 
-
-    if(block_write(0, buffer) != 0){
-      fprintf(stderr, "ERROR: Failure to write back the superblock!\n");
-      return -1;
-    }
-    fs.dirty = false; 
+  if(write_back() != 0){
+    return -1; 
   }
-
-  // bit map
-  if(ubm.dirty){
-    struct superblock* super_block = &fs; 
-    for(int i = 0; i < super_block->ub_bitmap_count; i++){
-      memset(buffer, 0, MAX_BLOCK_SIZE);
-      memcpy(buffer, ubm.ub_bitmap + i * MAX_BLOCK_SIZE, MAX_BLOCK_SIZE); 
-
-      if(block_write(super_block->ub_bitmap_offset + i , buffer) != 0){
-        fprintf(stderr, "ERROR: Failure to write back the bitmap segment!\n"); 
-        return -1; 
-      }
+  // everything is in place, the next mount has nothing to replay
+  if(journal.used){
+    char* buffer = disk_buf_get(dsk); 
+    if(buffer == NULL){
+      return -1; 
     }
-    ubm.dirty = false; 
-  }
-
-  // inodes
-  for(int i = 0; i < MAX_FILES; i++){
-    if(inodes[i].dirty){
-      memset(buffer, 0, MAX_BLOCK_SIZE);
-      memcpy(buffer ,&inodes[i], sizeof(struct inode)); 
-
-      int blknum = fs.im_offset + i / (MAX_BLOCK_SIZE / sizeof(struct inode)); 
-
-      if(block_write(blknum, buffer) != 0){
-        fprintf(stderr, "ERROR: Failure to write back the inode number!\n"); 
-        return -1; 
-      }
-
-      inodes[i].dirty = false; 
+    memset(buffer, 0, fs.block_size); 
+    int cleared = disk_sync(dsk) == 0 && disk_write(dsk, fs.journal_offset, buffer) == 0; 
+    disk_buf_put(dsk, buffer); 
+    if(!cleared){
+      fprintf(stderr, "ERROR: Failure to write the journal!\n"); 
+      return -1; 
     }
   }
+  journal_free(); 
+  tables_free(); 
+  cache_free(); 
 
-  if(close_disk() != 0){
+  int closed = disk_close(dsk); 
+  dsk = NULL; 
+  if(closed != 0){
     fprintf(stderr, "ERROR: Disk wouldnt close properly!\n"); 
     return -1; 
   }
 
+  free(ubm.ub_bitmap); 
+  free(ubm.held); 
+  ubm.ub_bitmap = NULL; 
+  ubm.held = NULL; 
+
   mounted = false;
   return 0; 
 }
 
+int umount_fs(const char *disk_name) {
+  // the commit thread takes dir_lock itself, it has to be gone first
+  journal_stop(); 
+  pthread_rwlock_wrlock(&dir_lock); 
+  int ret = umount_disk(disk_name); 
+  bool still = mounted; 
+  pthread_rwlock_unlock(&dir_lock); 
+  if(still){
+    journal_start(); 
+  }
+  return ret; 
+}
+
 
 // File System Functions
 
-int fs_open(const char *name){
+int open_file(const char *name){
 
   /*
   The file specified by name is opened for reading and writing, and the number of the file
@@ -420,36 +2580,63 @@ int fs_open(const char *name){
   } 
 
   /* Search for the file, if not found id will stay -1 */
-  int id = -1; 
-  for(int i = 0; i < MAX_FILES; i++){
-    if(strcmp(root[i].name, name) == 0 && root[i].is_used){
-      id = root[i].inode_num;
-      break;
-    }
-  }
+  int file_idx = dir_find(name); 
+  int id = file_idx == -1 ? -1 : root[file_idx].inode_num; 
 
   if(id == -1){
     fprintf(stderr, "ERROR: File not found!\n");
     return -1; 
   }
+  if(inode_get(id) == NULL){
+    return -1; 
+  }
 
+  // look on from the last descriptor handed out, then grow the table
   int fd_idx = -1; 
-  for(int i = 0; i < MAX_FILDES; i++){
+  for(size_t n = 0; n < nfds && fd_idx == -1; n++){
+    size_t i = (fd_hint + n) % nfds; 
     if(!fds[i].is_used){
       fd_idx = i; 
-      fds[i].inode_num = id; 
-      fds[i].is_used = true; 
-      fds[i].offset = 0; 
-      return fd_idx;
     }
   }
+  if(fd_idx == -1 && nfds < fd_limit){
+    size_t grown = nfds ? 2 * nfds : 8; 
+    if(grown > fd_limit){
+      grown = fd_limit; 
+    }
+    struct FD* table = realloc(fds, grown * sizeof(struct FD)); 
+    if(table == NULL){
+      fprintf(stderr, "ERROR: Failure to allocate file descriptors!\n");
+      return -1; 
+    }
+    memset(table + nfds, 0, (grown - nfds) * sizeof(struct FD)); 
+    fds = table; 
+    fd_idx = nfds; 
+    nfds = grown; 
+  }
 
-  fprintf(stderr, "ERROR: No file descriptor is available!\n");
-  return -1; 
+  if(fd_idx == -1){
+    fprintf(stderr, "ERROR: No file descriptor is available!\n");
+    return -1; 
+  }
 
+  memset(&fds[fd_idx], 0, sizeof(struct FD)); 
+  fds[fd_idx].inode_num = id; 
+  fds[fd_idx].is_used = true; 
+  fds[fd_idx].offset = 0; 
+  fd_hint = fd_idx + 1; 
+  open_count[id]++; 
+  return fd_idx;
 }
 
-int fs_close(const int fd){
+int fs_open(const char *name){
+  pthread_rwlock_wrlock(&dir_lock); 
+  int ret = open_file(name); 
+  pthread_rwlock_unlock(&dir_lock); 
+  return ret; 
+}
+
+int close_file(const int fd){
   /*
   The file descriptor fd is closed. A closed file descriptor can no longer be used to access the
   corresponding file. Upon successful completion, a value of 0 is returned. In case the file
@@ -461,18 +2648,33 @@ int fs_close(const int fd){
     return -1; 
   }
 
-  if(fd >= MAX_FILDES || fd < 0 || !fds[fd].is_used){
+  if(fd < 0 || (size_t) fd >= nfds || !fds[fd].is_used){
     fprintf(stderr, "ERROR: Invalid file descriptor!\n"); 
     return -1; 
   }
 
+  // the file's pending data goes to the disk, its buffer with the last descriptor
+  int inode_num = fds[fd].inode_num; 
+  int ret = pend_flush(&inodes[inode_num]); 
+  if(--open_count[inode_num] == 0){
+    free(imaps[inode_num].pend); 
+    imaps[inode_num].pend = NULL; 
+  }
   fds[fd].is_used = false; 
   fds[fd].inode_num = 0; 
   fds[fd].offset = 0; 
 
-  return 0;
+  return ret;
+}
+
+int fs_close(const int fd){
+  pthread_rwlock_wrlock(&dir_lock); 
+  int ret = close_file(fd); 
+  pthread_rwlock_unlock(&dir_lock); 
+  return ret; 
 }
-int fs_create(const char *name) {
+
+int create_file(const char *name) {
 
   /*
   This function creates a new file with name name in the root directory of your file system. The
@@ -495,53 +2697,71 @@ int fs_create(const char *name) {
   }
 
   // check if fname exists
-  for(int i = 0; i < MAX_FILES; i++){
-    if(root[i].is_used && strcmp(name, root[i].name) == 0){
-      fprintf(stderr, "ERROR: This file name already exists!\n");
-      return -1; 
-    }
+  if(dir_find(name) != -1){
+    fprintf(stderr, "ERROR: This file name already exists!\n");
+    return -1; 
   }
 
-  // find an unused inode to initialize
-  int inode_idx = -1; 
-  for(int i = 0; i < MAX_FILES; i++){
-    if(!inodes[i].is_used){
+  // unused entry in the root directory and an unused inode, looking on from the last ones taken
+  int file_idx = -1, inode_idx = -1; 
+  for(size_t n = 0; n < fs.max_files && file_idx == -1; n++){
+    size_t i = (dir.dentry_hint + n) % fs.max_files; 
+    if(!root[i].is_used){
+      file_idx = i; 
+    }
+  }
+  for(size_t n = 0; n < fs.max_files && inode_idx == -1; n++){
+    size_t i = (dir.inode_hint + n) % fs.max_files; 
+    struct inode* inode = inode_get(i); 
+    if(inode == NULL){
+      return -1; 
+    }
+    if(!inode->is_used){
       inode_idx = i; 
-      inodes[i].is_used = true; 
-      inodes[i].size = 0; 
-      inodes[i].type = REGULAR; 
-
-      memset(inodes[i].direct_offset, 0, sizeof(inodes[i].direct_offset));
-      inodes[i].single_indirect = 0; 
-      inodes[i].double_indirect = 0; 
-
-      inodes[i].dirty = true; 
-      break; 
     }
   }
 
+  if(file_idx == -1){
+    fprintf(stderr, "ERROR: Root is full!\n"); 
+    return -1; 
+  }
   if(inode_idx == -1){
     fprintf(stderr, "ERROR: No available inodes!\n");
     return -1;
   }
+  dir.dentry_hint = (file_idx + 1) % fs.max_files; 
+  dir.inode_hint = (inode_idx + 1) % fs.max_files; 
+
+  // initialize the inode
+  struct inode* inode = &inodes[inode_idx]; 
+  inode->is_used = true; 
+  inode->inode_num = inode_idx; 
+  inode->size = 0; 
+  inode->type = REGULAR; 
+  memset(&inode->map, 0, sizeof(inode->map));
+  inode->format = (fs.flags & FS_EXTENTS) ? EXTENTS : BLOCKMAP; 
+  inode->dirty = true; 
+
+  root[file_idx].is_used = true; 
+  strncpy(root[file_idx].name, name, MAX_FNAME_SIZE - 1); 
+  root[file_idx].name[MAX_FNAME_SIZE - 1] = '\0'; 
+  root[file_idx].inode_num = inode_idx; 
+  dir_insert(file_idx); 
+  dir_touch(file_idx); 
+  return 0; 
+}
 
-  // unused entry in the root directory
-  for(int i = 0; i < MAX_FILES; i++){
-    if(!root[i].is_used){
-      root[i].is_used = true; 
-      strncpy(root[i].name, name, MAX_FNAME_SIZE - 1); 
-      root[i].name[MAX_FNAME_SIZE - 1] = '\0'; 
-      root[i].inode_num = inode_idx; 
-      return 0; 
-    }
+int fs_create(const char *name) {
+  pthread_rwlock_wrlock(&dir_lock); 
+  int ret = create_file(name); 
+  if(ret == 0){
+    journal_note(); 
   }
-
-  fprintf(stderr, "ERROR: Root is full!\n"); 
-  return -1; 
+  pthread_rwlock_unlock(&dir_lock); 
+  return ret; 
 }
 
-
-int fs_delete(const char *name){
+int delete_file(const char *name){
 
   /*
   This function deletes the file with name name from the root directory of your file system and
@@ -559,13 +2779,7 @@ int fs_delete(const char *name){
   }
 
   // check if it even exists in directory
-  int file_idx = -1; 
-  for(int i = 0; i < MAX_FILES; i++){
-    if(strcmp(root[i].name, name) == 0 && root[i].is_used){
-      file_idx = i; 
-      break; 
-    }
-  }
+  int file_idx = dir_find(name); 
 
   if(file_idx == -1){
     fprintf(stderr, "ERROR: File does not exist!\n");
@@ -574,66 +2788,256 @@ int fs_delete(const char *name){
 
   // can't delete an open file
   int inode_num = root[file_idx].inode_num;
-  for(int i = 0; i < MAX_FILDES; i++){
-    if(fds[i].inode_num == inode_num && fds[i].is_used){
-      fprintf(stderr, "ERROR: File is currently open!\n");
-      return -1; 
-    }
+  if(open_count[inode_num] > 0){
+    fprintf(stderr, "ERROR: File is currently open!\n");
+    return -1; 
   }
 
-  for(int i = 0; i < 10; i++){
-    if(inodes[inode_num].direct_offset[i] != 0){
-      clear_bit(inodes[inode_num].direct_offset[i]);
-    }
+  if(inode_get(inode_num) == NULL || free_blocks(&inodes[inode_num], 0) != 0){
+    return -1; 
+  }
+  imap_release(&inodes[inode_num]); 
+
+  // the cleared inode has to reach the disk too
+  memset(&inodes[inode_num], 0, sizeof(struct inode)); 
+  inodes[inode_num].inode_num = inode_num; 
+  inodes[inode_num].dirty = true; 
+
+  dir_remove(file_idx); 
+  root[file_idx].is_used = false; 
+  memset(&root[file_idx], 0, sizeof(struct dentry)); 
+  dir_touch(file_idx); 
+
+  return 0; 
+}
+
+int fs_delete(const char *name){
+  pthread_rwlock_wrlock(&dir_lock); 
+  int ret = delete_file(name); 
+  if(ret == 0){
+    journal_note(); 
+  }
+  pthread_rwlock_unlock(&dir_lock); 
+  return ret; 
+}
+
+/*
+  Read-ahead for a read of blocks first..last through fd. A read that starts where the last
+  one ended is taken as part of a scan: the window doubles, from RA_MIN up to RA_MAX blocks,
+  and once less than half a window past last has been started, the blocks up to a full window
+  past it are read into the cache in the background. Any other read closes the window.
+  Nothing is read ahead through the host page cache, which already reads ahead of a scan and
+  lets whole blocks go straight into the caller's buffer faster than through the cache, nor for
+  a read that covers the window by itself.
+*/
+void read_ahead(struct FD* fd, struct inode* inode, size_t first, size_t last){
+  if(!readahead){
+    return; 
+  }
+  if(first != fd->ra_next){
+    fd->ra_window = 0; 
+    fd->ra_end = 0; 
+    return; 
   }
 
-  size_t blkptr = MAX_BLOCK_SIZE / sizeof(uint16_t); 
+  size_t window = fd->ra_window ? 2 * fd->ra_window : RA_MIN; 
+  if(window > RA_MAX){
+    window = RA_MAX; 
+  }
+  if(window > cache.nbufs / 4){
+    window = cache.nbufs / 4; 
+  }
+  fd->ra_window = window; 
+  if(last - first + 1 >= window){
+    return; 
+  }
 
-  // clearing single indirects if there is any
-  if(inodes[inode_num].single_indirect != 0){
-    uint16_t ib[blkptr]; 
-    block_read(inodes[inode_num].single_indirect, ib); 
+  size_t from = fd->ra_end > last + 1 ? fd->ra_end : last + 1; 
+  size_t to = last + 1 + window; 
+  size_t file_blocks = (inode->size + fs.block_size - 1) / fs.block_size; 
+  if(to > file_blocks){
+    to = file_blocks; 
+  }
+  if(from >= to || from - (last + 1) >= window / 2){
+    return; 
+  }
 
-    for(int i = 0; i < blkptr; i++){
-      if(ib[i] != 0){
-        clear_bit(ib[i]); 
+  uint32_t blocks[IO_BATCH]; 
+  struct ilock* il = &ilocks[inode_slot(inode)]; 
+  while(from < to){
+    size_t n = 0; 
+    pthread_mutex_lock(&il->map); 
+    for(; from < to && n < IO_BATCH; from++){
+      int block = get_block(inode, from, false); 
+      if(block == -1){
+        pthread_mutex_unlock(&il->map); 
+        return; 
+      }
+      if(block != 0){
+        blocks[n++] = block; 
       }
     }
-    clear_bit(inodes[inode_num].single_indirect);
-    inodes[inode_num].single_indirect = 0; 
+    pthread_mutex_unlock(&il->map); 
+    pthread_mutex_lock(&cache_lock); 
+    cache_readahead(blocks, n); 
+    pthread_mutex_unlock(&cache_lock); 
+    fd->ra_end = from; 
+  }
+}
+
+/*
+  The open descriptor fildes, with dir_lock held for reading and the rw lock of its inode held
+  shared, or alone with excl set. NULL, with nothing held, when the disk isn't mounted or fildes
+  isn't open on a file in use.
+*/
+struct FD* fd_lock(int fildes, bool excl){
+  pthread_rwlock_rdlock(&dir_lock); 
+  if(!mounted){
+    fprintf(stderr, "ERROR: Disk isn't mounted!\n"); 
+  }
+  else if(fildes < 0 || (size_t) fildes >= nfds || !fds[fildes].is_used){
+    fprintf(stderr, "ERROR: Invalid file descriptor!\n"); 
+  }
+  else if(!inodes[fds[fildes].inode_num].is_used){
+    fprintf(stderr, "ERROR: Inode isn't in use!\n"); 
+  }
+  else{
+    struct ilock* il = &ilocks[fds[fildes].inode_num]; 
+    if(excl){
+      pthread_rwlock_wrlock(&il->rw); 
+    }
+    else{
+      pthread_rwlock_rdlock(&il->rw); 
+    }
+    return &fds[fildes]; 
   }
+  pthread_rwlock_unlock(&dir_lock); 
+  return NULL; 
+}
 
-  // clearing double indirects if any
-  if(inodes[inode_num].double_indirect != 0){
-    uint16_t double_ib[blkptr]; 
-    block_read(inodes[inode_num].double_indirect, double_ib); 
-    
-    for(int i = 0; i < blkptr; i++){
-      if(double_ib[i] != 0){
-        uint16_t single_ib[blkptr]; 
-        block_read(double_ib[i], single_ib); 
+void fd_unlock(struct FD* fd){
+  pthread_rwlock_unlock(&ilocks[fd->inode_num].rw); 
+  pthread_rwlock_unlock(&dir_lock); 
+}
 
-        for(int j = 0; j < blkptr; j++){
-          if(single_ib[j] != 0){
-            clear_bit(single_ib[j]); 
-          }
-        }
-        clear_bit(double_ib[i]); 
+/*
+  fs_read and fs_pread past their checks: read up to nbyte bytes at offset of fd's file into
+  buf. Only fs_read passes seq, so positional reads leave fd's read-ahead alone.
+*/
+int file_read(struct FD* fd, void* buf, size_t nbyte, size_t offset, bool seq){
+  struct inode* inode = &inodes[fd->inode_num]; 
+
+  if(offset >= inode->size){
+    // offset is at the eof or surpasses it
+    return 0; 
+  }
+
+  // never read past the end of the file
+  if(nbyte > inode->size - offset){
+    nbyte = inode->size - offset; 
+  }
+
+  char* buffer = (char*) buf; 
+  size_t bytes_read = 0; 
+  size_t last = (offset + nbyte - 1) / fs.block_size; 
+  struct imap* m = &imaps[fd->inode_num]; 
+
+  if(seq){
+    read_ahead(fd, inode, offset / fs.block_size, last); 
+  }
+
+  // blocks are looked up IO_BATCH at a time. Whole blocks that aren't cached are read straight
+  // into buf, the rest go through the cache; each batch costs at most one block_readv of each
+  uint32_t blocks[IO_BATCH]; 
+  struct cbuf* ents[IO_BATCH]; 
+  int pos[IO_BATCH]; 
+  int direct_blocks[IO_BATCH]; 
+  void* direct_bufs[IO_BATCH]; 
+
+  while(bytes_read < nbyte){
+    size_t block_idx = offset / fs.block_size; 
+    size_t count = (last - block_idx + 1 < IO_BATCH) ? last - block_idx + 1 : IO_BATCH; 
+    size_t start = offset, end = offset + (nbyte - bytes_read); 
+
+    // map the batch, holes read back as zeroes and pending blocks come from the pending buffer
+    size_t nblocks = 0, ndirect = 0; 
+    for(size_t i = 0; i < count; i++){
+      if(m->pend_count && block_idx + i >= m->pend_first && block_idx + i - m->pend_first < m->pend_count){
+        pos[i] = -3; 
+        continue; 
+      }
+      pthread_mutex_lock(&ilocks[fd->inode_num].map); 
+      int block = get_block(inode, block_idx + i, false); 
+      pthread_mutex_unlock(&ilocks[fd->inode_num].map); 
+      if(block == -1){
+        return bytes_read ? (int) bytes_read : -1; 
+      }
+
+      size_t lo = (block_idx + i) * fs.block_size; 
+      bool cached = false; 
+      if(block != 0 && start <= lo && end >= lo + fs.block_size){
+        pthread_mutex_lock(&cache_lock); 
+        cached = cache_find(block) != -1; 
+        pthread_mutex_unlock(&cache_lock); 
+      }
+      if(block == 0){
+        pos[i] = -1; 
+      }
+      else if(start <= lo && end >= lo + fs.block_size && !cached){
+        pos[i] = -2; 
+        direct_blocks[ndirect] = block; 
+        direct_bufs[ndirect] = buffer + bytes_read + (lo - start); 
+        ndirect++; 
+      }
+      else{
+        pos[i] = (int) nblocks; 
+        blocks[nblocks++] = block; 
       }
     }
-    clear_bit(inodes[inode_num].double_indirect);
-    inodes[inode_num].double_indirect = 0;
-  }
 
-  ubm.dirty = true; 
+    pthread_mutex_lock(&cache_lock); 
+    int got = cache_getv(blocks, nblocks, ents, true); 
+    pthread_mutex_unlock(&cache_lock); 
+    if(got != 0){
+      return bytes_read ? (int) bytes_read : -1; 
+    }
+    if(ndirect > 0 && disk_readv(dsk, ndirect, direct_blocks, direct_bufs) != 0){
+      fprintf(stderr, "ERROR: Failed to read blocks!\n"); 
+      pthread_mutex_lock(&cache_lock); 
+      cache_putv(ents, nblocks); 
+      pthread_mutex_unlock(&cache_lock); 
+      return bytes_read ? (int) bytes_read : -1; 
+    }
 
-  inodes[inode_num].is_used = false;
-  memset(&inodes[inode_num], 0, sizeof(struct inode)); 
+    for(size_t i = 0; i < count && bytes_read < nbyte; i++){
+      size_t block_off = offset % fs.block_size; 
+      size_t read_size = fs.block_size - block_off; 
+      if(read_size > nbyte - bytes_read){
+        read_size = nbyte - bytes_read; 
+      }
 
-  root[file_idx].is_used = false; 
-  memset(&root[file_idx], 0, sizeof(struct dentry)); 
+      if(pos[i] == -1){
+        memset(buffer + bytes_read, 0, read_size); 
+      }
+      else if(pos[i] >= 0){
+        memcpy(buffer + bytes_read, ents[pos[i]]->data + block_off, read_size); 
+      }
+      else if(pos[i] == -3){
+        memcpy(buffer + bytes_read, m->pend + (block_idx + i - m->pend_first) * fs.block_size + block_off, read_size); 
+      }
+      bytes_read += read_size; 
+      offset += read_size; 
+    }
 
-  return 0; 
+    pthread_mutex_lock(&cache_lock); 
+    cache_putv(ents, nblocks); 
+    pthread_mutex_unlock(&cache_lock); 
+  }
+
+  if(seq){
+    fd->ra_next = offset / fs.block_size; 
+  }
+  return bytes_read;
 }
 
 int fs_read(int fildes, void *buf, size_t nbyte){
@@ -650,82 +3054,173 @@ int fs_read(int fildes, void *buf, size_t nbyte){
   of bytes that were actually read.
   */
 
-  if(!mounted){
-    fprintf(stderr, "ERROR: Disk isn't mounted!\n"); 
+  struct FD* fd = fd_lock(fildes, false); 
+  if(fd == NULL){
     return -1; 
   }
 
-  if(fildes < 0 || fildes >= MAX_FILDES || !fds[fildes].is_used){
-    fprintf(stderr, "ERROR: Invalid file descriptor!\n"); 
-    return -1; 
+  int bytes_read = file_read(fd, buf, nbyte, fd->offset, true); 
+  if(bytes_read > 0){
+    fd->offset += bytes_read; 
   }
+  fd_unlock(fd); 
+  return bytes_read; 
+}
 
-  struct FD* fd = &fds[fildes]; 
+// fs_write and fs_pwrite past their checks: write nbyte bytes of buf at offset of fd's file
+int file_write(struct FD* fd, const void* buf, size_t nbyte, size_t offset){
   struct inode* inode = &inodes[fd->inode_num]; 
+  const char* buffer = (const char*)buf; 
+  size_t bytes_written = 0; 
 
-  if(!inode->is_used){
-    fprintf(stderr, "ERROR: Inode isn't in use!\n"); 
-    return -1; 
-  }
-
-  if(fd->offset >= inode->size){
-    // offset is at the eof or surpasses it
+  if(nbyte == 0){
     return 0; 
   }
 
-  size_t bytes_read = 0; 
+  // blocks the file already has are updated IO_BATCH at a time in the cache and nothing is
+  // written until the cache writes back. Only a block that is partly overwritten and already
+  // holds file data has to be read first, those come in with one block_readv per batch.
+  // Blocks past them go to the file's pending buffer and get disk blocks when it is flushed
+  struct imap* m = &imaps[fd->inode_num]; 
+  size_t last = (offset + nbyte - 1) / fs.block_size; 
+  uint32_t blocks[IO_BATCH]; 
+  struct cbuf* ents[IO_BATCH]; 
+  bool disk_full = false; 
+  int ret = 0; 
+
+  while(bytes_written < nbyte && !disk_full){
+    size_t block_idx = offset / fs.block_size; 
+    size_t count = (last - block_idx + 1 < IO_BATCH) ? last - block_idx + 1 : IO_BATCH; 
+    size_t have = m->pend_count ? m->pend_first : (inode->size + fs.block_size - 1) / fs.block_size; 
+
+    if(block_idx >= have){
+      int room = pend_room(inode, block_idx); 
+      if(room < 0){
+        ret = -1; 
+        break; 
+      }
+      if(room){
+        if(m->pend_count == 0){
+          m->pend_first = block_idx; 
+        }
+        size_t page = block_idx - m->pend_first; 
+        char* data = m->pend + page * fs.block_size; 
+        if(page == m->pend_count){
+          memset(data, 0, fs.block_size); 
+          m->pend_count++; 
+        }
 
-  char* buffer = (char*) buf; 
+        size_t block_off = offset % fs.block_size; 
+        size_t write_size = fs.block_size - block_off; 
+        if(write_size > nbyte - bytes_written){
+          write_size = nbyte - bytes_written; 
+        }
+        memcpy(data + block_off, buffer + bytes_written, write_size); 
+        bytes_written += write_size; 
+        offset += write_size; 
+        if(offset > inode->size){
+          inode->size = offset; 
+          inode->dirty = true; 
+        }
+        continue; 
+      }
+
+      // the disk is close to full: this file's pending blocks take their disk blocks now, and
+      // the write allocates as it goes so it stops exactly where the unreserved blocks run out
+      if(pend_flush(inode) != 0){
+        ret = -1; 
+        break; 
+      }
+    }
+    else if(block_idx + count > have){
+      count = have - block_idx; 
+    }
 
-  size_t block_ptr = MAX_BLOCK_SIZE / sizeof(uint16_t); 
+    // blocks past the end of the file are new, set aside one contiguous run for them
+    if(block_idx + count > have){
+      reserve_run(inode, block_idx + count - (have > block_idx ? have : block_idx)); 
+    }
+
+    // map the batch, allocating as we go; stop at the first block the disk can't give us
+    size_t mapped = 0; 
+    for(; mapped < count; mapped++){
+      int block = get_block(inode, block_idx + mapped, true); 
+      if(block <= 0){
+        fprintf(stderr, "ERROR: No free blocks are available!\n"); 
+        disk_full = true; 
+        break; 
+      }
+      blocks[mapped] = block; 
+    }
 
-  while (nbyte > 0 && fd->offset < inode->size) {
-    size_t block_idx = fd->offset / MAX_BLOCK_SIZE;
-    size_t block_off = fd->offset % MAX_BLOCK_SIZE;
-    size_t bytes_in_block = MAX_BLOCK_SIZE - block_off;
-    size_t read_size = (bytes_in_block < nbyte) ? bytes_in_block : nbyte;
+    if(mapped == 0){
+      break; 
+    }
 
-    uint16_t block;
+    pthread_mutex_lock(&cache_lock); 
+    int got = cache_getv(blocks, mapped, ents, false); 
+    pthread_mutex_unlock(&cache_lock); 
+    if(got != 0){
+      ret = -1; 
+      break; 
+    }
 
-    // Direct blocks
-    if (block_idx < 10) {
-      block = inode->direct_offset[block_idx];
+    // partial blocks can only be the first and the last of the batch
+    struct cbuf* partial[2]; 
+    size_t npartial = 0; 
+    size_t start = offset, end = offset + (nbyte - bytes_written); 
+    for(size_t i = 0; i < mapped; i++){
+      size_t lo = (block_idx + i) * fs.block_size; 
+      bool whole = start <= lo && end >= lo + fs.block_size; 
+      if(!whole && lo < inode->size && !ents[i]->uptodate){
+        partial[npartial++] = ents[i]; 
+      }
     }
-    // Single indirect
-    else if (block_idx < 10 + block_ptr) {
-      uint16_t single_ib[block_ptr];
-      memset(single_ib, 0, sizeof(single_ib));
-      block_read(inode->single_indirect, single_ib);
-      block_idx -= 10;
-      block = single_ib[block_idx];
+    pthread_mutex_lock(&cache_lock); 
+    got = cache_fill(partial, npartial); 
+    if(got != 0){
+      cache_putv(ents, mapped); 
     }
-    // Double indirect
-    else {
-      block_idx -= 10 + block_ptr;
-      uint16_t double_ib_idx = block_idx / block_ptr;
-      uint16_t single_ib[block_ptr];
-      memset(single_ib,0,sizeof(single_ib));
-      block_read(inode->double_indirect, single_ib);
-      block_read(single_ib[double_ib_idx], single_ib);
-      block_idx %= block_ptr;
-      block = single_ib[block_idx];
+    pthread_mutex_unlock(&cache_lock); 
+    if(got != 0){
+      ret = -1; 
+      break; 
     }
 
-    char data[MAX_BLOCK_SIZE];
-    block_read(block, data);
+    for(size_t i = 0; i < mapped && bytes_written < nbyte; i++){
+      size_t block_off = offset % fs.block_size; 
+      size_t write_size = fs.block_size - block_off; 
+      if(write_size > nbyte - bytes_written){
+        write_size = nbyte - bytes_written; 
+      }
 
-    // Adjust read_size if it exceeds file size
-    if (fd->offset + read_size > inode->size) {
-      read_size = inode->size - fd->offset;
+      // a block past the end of the file has nothing worth reading, whatever the write
+      // doesn't cover is zero
+      if(!ents[i]->uptodate && write_size < fs.block_size){
+        memset(ents[i]->data, 0, fs.block_size); 
+      }
+      memcpy(ents[i]->data + block_off, buffer + bytes_written, write_size); 
+      ents[i]->uptodate = true; 
+      ents[i]->dirty = true; 
+      bytes_written += write_size; 
+      offset += write_size; 
+    }
+    if(offset > inode->size){
+      inode->size = offset; 
+      inode->dirty = true; 
     }
 
-    memcpy(buffer + bytes_read, data + block_off, read_size);
-    bytes_read += read_size;
-    fd->offset += read_size;
-    nbyte -= read_size;
+    pthread_mutex_lock(&cache_lock); 
+    cache_putv(ents, mapped); 
+    pthread_mutex_unlock(&cache_lock); 
   }
+  release_run(inode); 
 
-  return bytes_read;
+  if(ret != 0){
+    return -1; 
+  }
+
+  return bytes_written; 
 }
 
 int fs_write(int fildes, void *buf, size_t nbyte){
@@ -747,187 +3242,97 @@ int fs_write(int fildes, void *buf, size_t nbyte){
   number of bytes that were actually written.
   */
 
-  if(!mounted){
-    fprintf(stderr, "ERROR: Disk isn't mounted!\n");
+  struct FD* fd = fd_lock(fildes, true); 
+  if(fd == NULL){
     return -1; 
   }
 
-  if(fildes >= MAX_FILDES || fildes < 0 || !fds[fildes].is_used){
-    fprintf(stderr, "ERROR: Invalid file descriptor!\n");
-    return -1;
+  int bytes_written = file_write(fd, buf, nbyte, fd->offset); 
+  if(bytes_written > 0){
+    fd->offset += bytes_written; 
+    journal_note(); 
   }
+  fd_unlock(fd); 
 
-  struct FD* fd = &fds[fildes];
-  struct inode* inode = &inodes[fd->inode_num]; 
-  if(!inode->is_used){
-    fprintf(stderr, "ERROR: Inode isn't in use!\n");
-    return -1; 
+  // a full disk may only be waiting for a commit to give back the blocks freed since the last
+  if(bytes_written >= 0 && (size_t) bytes_written < nbyte && commit_held()){
+    int more = fs_write(fildes, (char*) buf + bytes_written, nbyte - bytes_written); 
+    bytes_written += more > 0 ? more : 0; 
   }
+  return bytes_written; 
+}
 
-  const char* buffer = (const char*)buf; 
-  const size_t original_offset = fd->offset; 
-  size_t bytes_written = 0; 
-  size_t block_ptr = MAX_BLOCK_SIZE / sizeof(uint16_t); 
-
-  while(bytes_written < nbyte){
-    size_t fpos = fd->offset + bytes_written; 
-    size_t block_idx = fpos / MAX_BLOCK_SIZE; 
-    size_t block_off = fpos % MAX_BLOCK_SIZE; 
-    // bytes remaining within the block
-    size_t byrem = MAX_BLOCK_SIZE - block_off;
-    size_t byte_write = (byrem < (nbyte - bytes_written)) ? byrem : (nbyte - bytes_written); 
-
-    uint16_t block; 
-
-    // direct blocks
-    if(block_idx < 10){
-      if(inode->direct_offset[block_idx] == 0){
-        int new_block = get_free_block(); 
-        if(new_block == -1){
-          fprintf(stderr, "ERROR: No free blocks are available!\n"); 
-          break; 
-        }
-        inode->direct_offset[block_idx] = new_block; 
-        ubm.dirty = true; 
-      }
-      block = inode->direct_offset[block_idx]; 
-    }
-
-    // single indirect blocks
-    else if(block_idx < 10 + block_ptr){
-      if(inode->single_indirect == 0){
-        int new_block = get_free_block(); 
-        if(new_block == -1){
-          fprintf(stderr, "ERROR: No free blocks are available!\n"); 
-          return bytes_written; 
-        } 
-        inode->single_indirect = new_block; 
-        ubm.dirty = true; 
-      }
-
-      uint16_t ib[block_ptr]; 
-      if(block_read(inode->single_indirect, &ib) != 0){
-        fprintf(stderr, "ERROR: Failed to read single indirect block!\n");
-        return -1; 
-      }
-
-      if(ib[block_idx - 10] == 0){
-        int new_block = get_free_block(); 
-        if(new_block == -1){
-          fprintf(stderr, "ERROR: No free blocks are available!\n"); 
-          return bytes_written; 
-        }
-
-        ib[block_idx - 10] = new_block; 
-        ubm.dirty = true; 
-        if(block_write(inode->single_indirect, &ib) != 0){
-          fprintf(stderr, "ERROR: Failed to write single indirect block!\n"); 
-          return -1; 
-        } 
-      }
-      block = ib[block_idx - 10]; 
-    }
-
-    // double indirect block
-    else{
-      size_t double_iidx = (block_idx - 10 - block_ptr) / block_ptr; 
-      size_t single_iidx = (block_idx - 10 - block_ptr) % block_ptr; 
-
-      if(inode->double_indirect == 0){
-        int new_block = get_free_block(); 
-        if(new_block == -1){
-          fprintf(stderr, "ERROR: No free blocks are available!\n"); 
-          return bytes_written; 
-        }
-        inode->double_indirect = new_block; 
-        ubm.dirty = true; 
-      }
-
-      uint16_t double_ib[block_ptr]; 
-      if(block_read(inode->double_indirect, &double_ib) != 0){
-        fprintf(stderr, "ERROR: Failed to read double indirect block!\n"); 
-        break; 
-      }
-
-      if(double_ib[double_iidx] == 0){
-        int new_block = get_free_block(); 
-        if(new_block == -1){
-          fprintf(stderr, "ERROR: No free blocks are available!\n"); 
-          return bytes_written; 
-        }
+int fs_pread(int fildes, void *buf, size_t nbyte, off_t offset){
 
-        double_ib[double_iidx] = new_block; 
-        ubm.dirty = true; 
-        if(block_write(inode->double_indirect, &double_ib) != 0){
-          fprintf(stderr, "ERROR: Failed to write double indirect block!\n"); 
-          break; 
-        }
+  /*
+  Like fs_read, but reads at offset instead of at the file pointer, which is left as it is. An
+  offset at or past the end of the file reads nothing; a negative one is a failure.
+  */
 
-        uint16_t single_ib[block_ptr]; 
-        if(block_read(double_ib[double_iidx], &single_ib) != 0){
-          fprintf(stderr, "ERROR: Failed to read single indirect block in the double indirect block!\n"); 
-          break; 
-        }
+  if(offset < 0){
+    fprintf(stderr, "ERROR: Invalid offset!\n");
+    return -1;
+  }
 
-        if(single_ib[single_iidx] == 0){
-          int new_block = get_free_block(); 
-          if(new_block == -1){
-            fprintf(stderr, "ERROR: No free blocks are available!\n"); 
-            return bytes_written; 
-          }
-          single_ib[single_iidx] = new_block; 
-          ubm.dirty = true; 
-          if(block_write(double_ib[double_iidx], &single_ib) != 0){
-            fprintf(stderr, "ERROR: Failed to write single indirect block in double indirect block !\n");
-            break; 
-          }
-        }
-        block = single_ib[single_iidx]; 
-      }
+  struct FD* fd = fd_lock(fildes, false); 
+  if(fd == NULL){
+    return -1; 
+  }
 
-    }
+  int bytes_read = file_read(fd, buf, nbyte, offset, false); 
+  fd_unlock(fd); 
+  return bytes_read; 
+}
 
-    char blk_buffer[MAX_BLOCK_SIZE];
-    if(block_read(block, &blk_buffer) != 0){
-      fprintf(stderr, "ERROR: Failed to read block!\n"); 
-      return -1; 
-    }
+int fs_pwrite(int fildes, void *buf, size_t nbyte, off_t offset){
 
-    memcpy(blk_buffer + block_off, buffer + bytes_written, byte_write); 
-    if(block_write(block, &blk_buffer) != 0){
-      fprintf(stderr, "ERROR: Failed to write block!\n");
-      return -1; 
-    }
+  /*
+  Like fs_write, but writes at offset instead of at the file pointer, which is left as it is.
+  As with fs_lseek, it is a failure when offset is less than zero or larger than the file size.
+  */
 
-    bytes_written += byte_write; 
-    fd->offset += byte_write; 
+  struct FD* fd = fd_lock(fildes, true); 
+  if(fd == NULL){
+    return -1; 
   }
 
-  if((original_offset + bytes_written) >= inode->size){
-    inode->size = original_offset + bytes_written; 
-    inode->dirty = true; 
+  int bytes_written = -1; 
+  if(offset < 0 || offset > inodes[fd->inode_num].size){
+    fprintf(stderr, "ERROR: Invalid offset!\n");
+  }
+  else{
+    bytes_written = file_write(fd, buf, nbyte, offset); 
+  }
+  if(bytes_written > 0){
+    journal_note(); 
   }
+  fd_unlock(fd); 
 
+  if(bytes_written >= 0 && (size_t) bytes_written < nbyte && commit_held()){
+    int more = fs_pwrite(fildes, (char*) buf + bytes_written, nbyte - bytes_written, offset + bytes_written); 
+    bytes_written += more > 0 ? more : 0; 
+  }
   return bytes_written; 
 }
 
 int fs_get_filesize(int fildes){
-  
+
   /*
   This function returns the current size of the file referenced by the file descriptor fd. In case fd is
   invalid, the function returns -1.
   */
 
-  if(fildes < 0 || fildes >= MAX_FILDES || !fds[fildes].is_used){
-    fprintf(stderr, "ERROR: Invalid file descriptor!\n"); 
+  struct FD* fd = fd_lock(fildes, false); 
+  if(fd == NULL){
     return -1; 
   }
 
-  return inodes[fds[fildes].inode_num].size; 
-  
+  int size = inodes[fd->inode_num].size; 
+  fd_unlock(fd); 
+  return size; 
 }
 
-int fs_listfiles(char ***files){
+int list_files(char ***files){
 
   /*
   This function creates and populates an array of all filenames currently known to the file system.
@@ -941,7 +3346,7 @@ int fs_listfiles(char ***files){
   }
 
   int file_count = 0; 
-  for(int i = 0; i < MAX_FILES; i++){
+  for(size_t i = 0; i < fs.max_files; i++){
     if(root[i].is_used){
       file_count++; 
     }
@@ -954,7 +3359,7 @@ int fs_listfiles(char ***files){
   }
 
   int i = 0; 
-  for(int j = 0; j < MAX_FILES; j++){
+  for(size_t j = 0; j < fs.max_files; j++){
     if(root[j].is_used){
       //duplicating the names into file array
       (*files)[i] = strdup(root[j].name); 
@@ -975,6 +3380,13 @@ int fs_listfiles(char ***files){
   return 0; 
 }
 
+int fs_listfiles(char ***files){
+  pthread_rwlock_rdlock(&dir_lock); 
+  int ret = list_files(files); 
+  pthread_rwlock_unlock(&dir_lock); 
+  return ret; 
+}
+
 int fs_lseek(int fildes, off_t offset){
 
   /*
@@ -986,27 +3398,21 @@ int fs_lseek(int fildes, off_t offset){
   when the requested offset is larger than the file size, or when offset is less than zero.
   */
 
-  if(!mounted){
-    fprintf(stderr, "ERROR: Disk isn't mounted!\n");
+  struct FD* fd = fd_lock(fildes, false); 
+  if(fd == NULL){
     return -1; 
   }
 
-  if(fildes >= MAX_FILDES || fildes < 0 || !fds[fildes].is_used) {
-    fprintf(stderr, "ERROR: Invalid file descriptor!\n");
-    return -1;
-  }
-
-  struct FD* fd = &fds[fildes]; 
-  struct inode* inode = &inodes[fd->inode_num]; 
-
-  if(offset < 0 || offset > inode->size){
+  int ret = -1; 
+  if(offset < 0 || offset > inodes[fd->inode_num].size){
     fprintf(stderr, "ERROR: Invalid offset!\n");
-    return -1;
   }
-
-  fd->offset = offset; 
-
-  return 0; 
+  else{
+    fd->offset = offset; 
+    ret = 0; 
+  }
+  fd_unlock(fd); 
+  return ret; 
 }
 
 int fs_truncate(int fildes, off_t length){
@@ -1020,84 +3426,29 @@ int fs_truncate(int fildes, off_t length){
   failure when the file descriptor fd is invalid or the requested length is larger than the file size.
   */
 
-  if(!mounted){
-    fprintf(stderr, "ERROR: Disk isn't mounted!\n"); 
-    return -1; 
-  }
-
-  if(fildes < 0 || fildes >= MAX_FILDES || !fds[fildes].is_used){
-    fprintf(stderr, "ERROR: Invalid file descriptor\n");
+  struct FD* fd = fd_lock(fildes, true); 
+  if(fd == NULL){
     return -1; 
   }
 
-  struct FD* fd = &fds[fildes]; 
   struct inode* inode = &inodes[fd->inode_num]; 
+  int ret = -1; 
+  size_t new_block_count = (length + fs.block_size - 1) / fs.block_size; 
 
   if(length > inode->size){
     fprintf(stderr, "ERROR: Length is larger than file size!\n"); 
-    return -1; 
-  }
-
-  inode->size = length; 
-
-  size_t block_ptr = MAX_BLOCK_SIZE / sizeof(uint16_t); 
-  size_t new_block_count = (length + MAX_BLOCK_SIZE - 1) / MAX_BLOCK_SIZE; 
-
-  for(size_t i = new_block_count; i < 10; i++){
-    if(inode->direct_offset[i] != 0){
-      clear_bit(inode->direct_offset[i]); 
-      ubm.dirty = true; 
-      inode->direct_offset[i] = 0;
-    }
   }
-
-  if(new_block_count <= 10){
-    if(inode->single_indirect != 0){
-      uint16_t ib[block_ptr]; 
-      block_read(inode->single_indirect, &ib);
-
-      for (size_t i = 0; i < block_ptr; i++) {
-        if (ib[i] != 0) {
-          clear_bit(ib[i]);
-          ubm.dirty = true;
-        }
-      }
-      clear_bit(inode->single_indirect);
-      ubm.dirty = true;
-      inode->single_indirect = 0;
-    }
-
-    if (inode->double_indirect != 0) {
-      uint16_t double_ib[block_ptr];
-      block_read(inode->double_indirect, &double_ib);
-
-      for (size_t i = 0; i < block_ptr; i++) {
-        if (double_ib[i] != 0) {
-          uint16_t single_ib[block_ptr];
-          block_read(double_ib[i], &single_ib);
-
-          for (size_t j = 0; j < block_ptr; j++) {
-            if (single_ib[j] != 0) {
-              clear_bit(single_ib[j]);
-              ubm.dirty = true;
-            }
-          }
-          clear_bit(double_ib[i]);
-          ubm.dirty = true;
-          double_ib[i] = 0; // Update the double_ib array
-        }
-      }
-      if (block_write(inode->double_indirect, &double_ib) != 0) {
-        fprintf(stderr, "ERROR: Failed to write updated double indirect block!\n");
-        return -1;
-      }
-      inode->double_indirect = 0;
-    }
+  // blocks are only freed once they have been allocated
+  else if(pend_flush(inode) == 0){
+    inode->size = length; 
+    ret = free_blocks(inode, new_block_count); 
+    journal_note(); 
   }
 
-  if (fd->offset > length) {
+  if(ret == 0 && fd->offset > length){
     fd->offset = length;
   }
 
-  return 0;   
+  fd_unlock(fd); 
+  return ret; 
 }
\ No newline at end of file
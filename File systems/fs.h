@@ -2,8 +2,17 @@
 #define INCLUDE_FS_H
 #include <sys/types.h>
 
+#define FS_EXTENTS 0x1 /* make_fs_flags: map new files with extents */
+
+/* Any of these can be called from several threads at once. A descriptor is used by one thread
+ * at a time, except through fs_pread and fs_pwrite. */
+
 int make_fs(const char *disk_name);
+int make_fs_geometry(const char *disk_name, int blocks, int block_size);
+int make_fs_flags(const char *disk_name, int flags); /* flags: FS_* */
+int make_fs_files(const char *disk_name, int files); /* room for files files (make_fs: 64) */
 int mount_fs(const char *disk_name);
+int mount_fs_flags(const char *disk_name, int flags); /* flags: DISK_* from disk.h */
 int umount_fs(const char *disk_name);
 int fs_open(const char *name);
 int fs_close(int fildes);
@@ -11,8 +20,14 @@ int fs_create(const char *name);
 int fs_delete(const char *name);
 int fs_read(int fildes, void *buf, size_t nbyte);
 int fs_write(int fildes, void *buf, size_t nbyte);
+int fs_pread(int fildes, void *buf, size_t nbyte, off_t offset);  /* leaves the file pointer */
+int fs_pwrite(int fildes, void *buf, size_t nbyte, off_t offset); /* leaves the file pointer */
 int fs_get_filesize(int fildes);
 int fs_listfiles(char ***files);
 int fs_lseek(int fildes, off_t offset);
 int fs_truncate(int fildes, off_t length);
+int fs_sync(void);                    /* write cached blocks and metadata back to the disk;
+                                       * a mounted disk also does this once a second */
+int fs_cache_size(size_t blocks);     /* block cache capacity, in blocks */
+int fs_fd_limit(size_t fds);          /* most file descriptors open at once (default 32) */
 #endif /* INCLUDE_FS_H */
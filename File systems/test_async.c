@@ -0,0 +1,96 @@
+#include "disk.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define RUNS 200 // more requests than the queue holds, so submitting waits for room
+#define RUN_MAX 3
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int completed;
+static int failed;
+
+static void done(void *arg, int status) {
+  pthread_mutex_lock(&lock);
+  completed++;
+  if (status != 0) {
+    failed++;
+  }
+  *(int *)arg = status;
+  pthread_mutex_unlock(&lock);
+}
+
+int main() {
+  const char *disk_name = "test_disk";
+  char *data = malloc((size_t)RUNS * RUN_MAX * BLOCK_SIZE);
+  char *back = malloc((size_t)RUNS * RUN_MAX * BLOCK_SIZE);
+  int status[RUNS];
+  int block[RUNS];
+  int count[RUNS];
+
+  for (size_t i = 0; i < (size_t)RUNS * RUN_MAX * BLOCK_SIZE; i++) {
+    data[i] = 'a' + (i * 7 + i / BLOCK_SIZE) % 26;
+  }
+  memset(back, 0, (size_t)RUNS * RUN_MAX * BLOCK_SIZE);
+
+  remove(disk_name);
+  assert(make_disk(disk_name) == 0);
+  assert(open_disk(disk_name) == 0);
+  assert(disk_poll(NULL) == 0);
+  assert(disk_drain(NULL) == 0); // nothing was ever submitted
+
+  // runs of 1 to RUN_MAX blocks, spread over the disk out of order
+  for (int r = 0; r < RUNS; r++) {
+    count[r] = 1 + r % RUN_MAX;
+    block[r] = ((r * 37) % RUNS) * RUN_MAX;
+    status[r] = 1;
+    assert(block_submit(1, block[r], count[r], data + (size_t)r * RUN_MAX * BLOCK_SIZE, done, &status[r]) == 0);
+  }
+  assert(disk_drain(NULL) == 0);
+  assert(disk_poll(NULL) == 0);
+  assert(completed == RUNS && failed == 0);
+  for (int r = 0; r < RUNS; r++) {
+    assert(status[r] == 0);
+  }
+
+  // read them back through the queue, and once more synchronously
+  for (int r = 0; r < RUNS; r++) {
+    assert(block_submit(0, block[r], count[r], back + (size_t)r * RUN_MAX * BLOCK_SIZE, done, &status[r]) == 0);
+  }
+  assert(disk_drain(NULL) == 0);
+  assert(completed == 2 * RUNS && failed == 0);
+  for (int r = 0; r < RUNS; r++) {
+    size_t off = (size_t)r * RUN_MAX * BLOCK_SIZE;
+    assert(memcmp(back + off, data + off, (size_t)count[r] * BLOCK_SIZE) == 0);
+    assert(block_read(block[r], back) == 0);
+    assert(memcmp(back, data + off, BLOCK_SIZE) == 0);
+  }
+
+  // a request without a callback
+  assert(block_submit(1, DISK_BLOCKS - 1, 1, data, NULL, NULL) == 0);
+  assert(disk_drain(NULL) == 0);
+  assert(block_read(DISK_BLOCKS - 1, back) == 0);
+  assert(memcmp(back, data, BLOCK_SIZE) == 0);
+
+  // bad requests are refused up front
+  assert(block_submit(0, DISK_BLOCKS - 1, 2, back, done, &status[0]) == -1);
+  assert(block_submit(0, -1, 1, back, done, &status[0]) == -1);
+  assert(block_submit(0, 0, 0, back, done, &status[0]) == -1);
+
+  // a request that fails on the disk reaches its callback and the next drain, only once
+  assert(truncate(disk_name, DISK_HDR_SIZE + (off_t)(DISK_BLOCKS - 8) * BLOCK_SIZE) == 0);
+  assert(block_submit(0, DISK_BLOCKS - 1, 1, back, done, &status[0]) == 0);
+  assert(disk_drain(NULL) == -1);
+  assert(status[0] == -1 && failed == 1);
+  assert(disk_drain(NULL) == 0);
+
+  assert(close_disk() == 0);
+  assert(remove(disk_name) == 0);
+  free(data);
+  free(back);
+  printf("Async test passed!\n");
+  return 0;
+}
@@ -0,0 +1,72 @@
+#include "fs.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BYTES_KB 1024
+#define BYTES_MB (1024 * BYTES_KB)
+#define BYTES_4MB (4 * BYTES_MB)
+
+int main() {
+  const char *disk_name = "test_fs";
+  char *write_buf = malloc(BYTES_4MB);
+  char *read_buf = malloc(BYTES_4MB);
+  int fd;
+
+  for (int i = 0; i < BYTES_4MB; i++) {
+    write_buf[i] = 'a' + (i % 23);
+  }
+
+  remove(disk_name);
+  assert(make_fs(disk_name) == 0);
+  assert(fs_cache_size(16) == -1); // too small for a batch
+  assert(fs_sync() == -1);         // disk not mounted
+
+  // a 4 MiB file through a 512 KiB cache: blocks are written back as they are replaced
+  assert(fs_cache_size(128) == 0);
+  assert(mount_fs(disk_name) == 0);
+  assert(fs_create("big") == 0);
+  fd = fs_open("big");
+  assert(fd >= 0);
+  assert(fs_write(fd, write_buf, BYTES_4MB) == BYTES_4MB);
+  assert(fs_lseek(fd, 0) == 0);
+  assert(fs_read(fd, read_buf, BYTES_4MB) == BYTES_4MB);
+  assert(memcmp(read_buf, write_buf, BYTES_4MB) == 0);
+
+  // overwrite the middle of the file, then sync it out explicitly
+  assert(fs_lseek(fd, BYTES_MB + 100) == 0);
+  assert(fs_write(fd, "cached", 6) == 6);
+  memcpy(write_buf + BYTES_MB + 100, "cached", 6);
+  assert(fs_sync() == 0);
+
+  // growing the cache while mounted keeps everything that was written
+  assert(fs_cache_size(2048) == 0);
+  assert(fs_lseek(fd, 0) == 0);
+  assert(fs_read(fd, read_buf, BYTES_4MB) == BYTES_4MB);
+  assert(memcmp(read_buf, write_buf, BYTES_4MB) == 0);
+  assert(fs_close(fd) == 0);
+
+  // a deleted file's dirty blocks are dropped, not written over the next file
+  assert(fs_create("small") == 0);
+  fd = fs_open("small");
+  assert(fs_write(fd, write_buf, 8 * BYTES_KB) == 8 * BYTES_KB);
+  assert(fs_close(fd) == 0);
+  assert(fs_delete("small") == 0);
+  assert(umount_fs(disk_name) == 0);
+
+  // everything reached the disk at umount
+  assert(mount_fs(disk_name) == 0);
+  fd = fs_open("big");
+  assert(fd >= 0);
+  assert(fs_read(fd, read_buf, BYTES_4MB) == BYTES_4MB);
+  assert(memcmp(read_buf, write_buf, BYTES_4MB) == 0);
+  assert(fs_close(fd) == 0);
+  assert(umount_fs(disk_name) == 0);
+
+  assert(remove(disk_name) == 0);
+  free(write_buf);
+  free(read_buf);
+  printf("Cache test passed!\n");
+  return 0;
+}
@@ -0,0 +1,137 @@
+#include "fs.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FILES 128 // the directory index of a mount has 256 slots
+#define SLOTS 256
+#define NAMES 400
+#define CLUSTER 24
+#define OPS 20000
+#define REMOUNT 2500
+
+static char names[NAMES][16];
+static int present[NAMES];
+static int count;
+
+// the home slot of name in the directory index, as fs.c hashes it
+static size_t slot_of(const char *name) {
+  uint32_t h = 2166136261u;
+  for (; *name; name++) {
+    h = (h ^ (uint8_t)*name) * 16777619u;
+  }
+  return h & (SLOTS - 1);
+}
+
+static void check_all(void) {
+  char **files;
+  int listed = 0;
+
+  assert(fs_listfiles(&files) == 0);
+  for (int i = 0; files[i] != NULL; i++, listed++) {
+    int found = 0;
+    for (int n = 0; n < NAMES; n++) {
+      if (present[n] && strcmp(files[i], names[n]) == 0) {
+        found = 1;
+      }
+    }
+    assert(found);
+    free(files[i]);
+  }
+  free(files);
+  assert(listed == count);
+
+  for (int n = 0; n < NAMES; n++) {
+    if (present[n]) {
+      int fd = fs_open(names[n]);
+      assert(fd >= 0);
+      assert(fs_close(fd) == 0);
+    }
+  }
+}
+
+static void create(int n) {
+  assert(fs_create(names[n]) == 0);
+  present[n] = 1;
+  count++;
+}
+
+static void delete(int n) {
+  assert(fs_delete(names[n]) == 0);
+  present[n] = 0;
+  count--;
+}
+
+int main() {
+  const char *disk_name = "test_fs";
+  int clustered = 0;
+
+  // names[0..CLUSTER) all hash to the last two slots and the first, so their probe run wraps
+  // around the end of the table
+  for (int i = 0; clustered < CLUSTER; i++) {
+    snprintf(names[clustered], sizeof(names[0]), "f%d", i);
+    size_t s = slot_of(names[clustered]);
+    if (s >= SLOTS - 2 || s == 0) {
+      clustered++;
+    }
+  }
+  for (int n = clustered; n < NAMES; n++) {
+    snprintf(names[n], sizeof(names[0]), "g%d", n);
+  }
+
+  remove(disk_name);
+  assert(make_fs_files(disk_name, FILES) == 0);
+  assert(mount_fs(disk_name) == 0);
+
+  // take entries out of the middle and the front of the run: everything after them has to
+  // stay reachable, whichever side of the wrap it sits on
+  for (int i = 0; i < CLUSTER; i++) {
+    create(i);
+  }
+  check_all();
+  for (int i = 1; i < CLUSTER; i += 3) {
+    delete(i);
+    check_all();
+  }
+  delete(0);
+  check_all();
+  for (int i = 1; i < CLUSTER; i += 3) {
+    create(i);
+  }
+  check_all();
+  assert(umount_fs(disk_name) == 0);
+  assert(mount_fs(disk_name) == 0);
+  check_all();
+
+  // random creates, deletes and lookups against the reference set, with remounts in between
+  unsigned seed = 17;
+  for (int op = 1; op <= OPS; op++) {
+    int n = rand_r(&seed) % NAMES;
+    int r = rand_r(&seed) % 16;
+    if (present[n] && r < 8) {
+      delete(n);
+    } else if (present[n]) {
+      int fd = fs_open(names[n]);
+      assert(fd >= 0);
+      assert(fs_close(fd) == 0);
+    } else if (r == 0) {
+      assert(fs_open(names[n]) == -1);
+    } else if (count < FILES) {
+      create(n);
+    }
+
+    if (op % REMOUNT == 0) {
+      check_all();
+      assert(umount_fs(disk_name) == 0);
+      assert(mount_fs(disk_name) == 0);
+      check_all();
+    }
+  }
+  assert(umount_fs(disk_name) == 0);
+
+  assert(remove(disk_name) == 0);
+  printf("Directory index test passed!\n");
+  return 0;
+}
@@ -0,0 +1,85 @@
+#include "disk.h"
+#include "fs.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BYTES_KB 1024
+#define BYTES_MB (1024 * BYTES_KB)
+#define SIZE (2 * BYTES_MB + 5)
+
+static void check(const char *name, const char *data, size_t len, size_t misalign) {
+  char *mem = malloc(len + 16);
+  char *buf = mem + misalign;
+  int fd = fs_open(name);
+  assert(fd >= 0);
+  assert(fs_read(fd, buf, len) == (int)len);
+  assert(memcmp(buf, data, len) == 0);
+  assert(fs_close(fd) == 0);
+  free(mem);
+}
+
+int main() {
+  const char *disk_name = "test_fs";
+  char *mem = malloc(SIZE + 16);
+  char *data = mem + 1; // never aligned to DISK_ALIGN
+  int fd;
+
+  for (int i = 0; i < SIZE; i++) {
+    data[i] = 'a' + (i * 5) % 26;
+  }
+
+  remove(disk_name);
+  assert(make_fs(disk_name) == 0);
+
+  // written from and read into unaligned buffers, both bounce through the pool
+  assert(mount_fs_flags(disk_name, DISK_DIRECT) == 0);
+  assert(fs_create("direct") == 0);
+  fd = fs_open("direct");
+  assert(fs_write(fd, data, SIZE) == SIZE);
+  assert(fs_close(fd) == 0);
+  assert(umount_fs(disk_name) == 0);
+
+  // a fresh mount, so fs_read goes to the disk straight into the caller's buffer
+  assert(mount_fs_flags(disk_name, DISK_DIRECT) == 0);
+  check("direct", data, SIZE, 3);
+  assert(umount_fs(disk_name) == 0);
+  assert(mount_fs(disk_name) == 0);
+  check("direct", data, SIZE, 0);
+  assert(umount_fs(disk_name) == 0);
+
+  // the block calls themselves, on a disk of its own
+  struct disk *d = disk_open(disk_name, DISK_DIRECT);
+  assert(d != NULL);
+  // O_DIRECT may have fallen back on a file system that refuses it, nothing else is on
+  assert((disk_mode(d) & ~DISK_DIRECT) == 0);
+  char *pool = disk_buf_get(d);
+  assert(pool != NULL && (uintptr_t)pool % DISK_ALIGN == 0);
+  assert(disk_write(d, disk_blocks(d) - 1, data) == 0);
+  assert(disk_read(d, disk_blocks(d) - 1, pool) == 0);
+  assert(memcmp(pool, data, BLOCK_SIZE) == 0);
+
+  char *back = malloc(3 * BLOCK_SIZE + 16);
+  int blocks[3] = {disk_blocks(d) - 3, disk_blocks(d) - 2, disk_blocks(d) - 1};
+  const void *wbufs[3] = {data, data + 2 * BLOCK_SIZE, pool};
+  void *rbufs[3] = {back + 7, back + 7 + BLOCK_SIZE, back + 7 + 2 * BLOCK_SIZE};
+  assert(disk_writev(d, 3, blocks, wbufs) == 0);
+  assert(disk_readv(d, 3, blocks, rbufs) == 0);
+  assert(memcmp(rbufs[0], data, BLOCK_SIZE) == 0);
+  assert(memcmp(rbufs[1], data + 2 * BLOCK_SIZE, BLOCK_SIZE) == 0);
+  assert(memcmp(rbufs[2], data, BLOCK_SIZE) == 0);
+  disk_buf_put(d, pool);
+  disk_buf_flush(d);
+  assert(disk_close(d) == 0);
+  free(back);
+
+  // there is no page cache to map
+  assert(disk_open(disk_name, DISK_DIRECT | DISK_MMAP) == NULL);
+
+  assert(remove(disk_name) == 0);
+  free(mem);
+  printf("Direct test passed!\n");
+  return 0;
+}
@@ -0,0 +1,115 @@
+#include "disk.h"
+#include "fs.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ROUNDS 200
+
+struct job {
+  struct disk *d; // NULL for the default disk
+  char tag;
+};
+
+// fill every block of a disk with its tag and block number, then check them all
+static void *hammer(void *arg) {
+  struct job *job = arg;
+  int bsize = disk_block_size(job->d);
+  int blocks = disk_blocks(job->d);
+  char *buf = malloc(bsize);
+  char *back = malloc(bsize);
+
+  for (int r = 0; r < ROUNDS; r++) {
+    int b = (r * 31) % blocks;
+    memset(buf, job->tag, bsize);
+    memcpy(buf, &b, sizeof(b));
+    assert(disk_write(job->d, b, buf) == 0);
+    assert(disk_read(job->d, b, back) == 0);
+    assert(memcmp(buf, back, bsize) == 0);
+  }
+
+  free(buf);
+  free(back);
+  return NULL;
+}
+
+int main() {
+  const char *names[3] = {"test_disk0", "test_disk1", "test_disk2"};
+  const char *fs_name = "test_fs";
+  pthread_t threads[3];
+  struct job jobs[3];
+
+  for (int i = 0; i < 3; i++) {
+    remove(names[i]);
+  }
+  assert(make_disk(names[0]) == 0);
+  assert(make_disk_geometry(names[1], 1024, 4096, 0) == 0);
+  assert(make_disk_geometry(names[2], 512, 1024, 0) == 0);
+
+  // the default disk and two handles, each with its own geometry
+  assert(open_disk(names[0]) == 0);
+  struct disk *a = disk_open(names[1], 0);
+  struct disk *b = disk_open(names[2], DISK_MMAP);
+  assert(a != NULL && b != NULL);
+  assert(disk_blocks(NULL) == DISK_BLOCKS && disk_block_size(NULL) == BLOCK_SIZE);
+  assert(disk_blocks(a) == 1024 && disk_block_size(a) == 4096);
+  assert(disk_blocks(b) == 512 && disk_block_size(b) == 1024);
+  struct disk *again = disk_open(names[1], 0); // the same image gets a handle of its own
+  assert(again != NULL && again != a);
+  assert(disk_close(again) == 0);
+
+  // I/O on all three at once
+  jobs[0] = (struct job){NULL, 'x'};
+  jobs[1] = (struct job){a, 'y'};
+  jobs[2] = (struct job){b, 'z'};
+  for (int i = 0; i < 3; i++) {
+    assert(pthread_create(&threads[i], NULL, hammer, &jobs[i]) == 0);
+  }
+  for (int i = 0; i < 3; i++) {
+    assert(pthread_join(threads[i], NULL) == 0);
+  }
+
+  // a block written on one disk isn't seen on the others
+  char buf[BLOCK_SIZE];
+  memset(buf, 'q', sizeof(buf));
+  assert(block_write(31, buf) == 0);
+  assert(disk_read(a, 31, buf) == 0);
+  assert(buf[sizeof(int)] == 'y');
+  assert(disk_read(b, 31, buf) == 0);
+  assert(buf[sizeof(int)] == 'z');
+
+  // a mounted file system keeps its disk in a handle of its own, next to the others
+  remove(fs_name);
+  assert(make_fs(fs_name) == 0);
+  assert(mount_fs_flags(fs_name, 0) == 0);
+  assert(fs_create("file") == 0);
+  int fd = fs_open("file");
+  assert(fs_write(fd, "on the fs disk", 14) == 14);
+  assert(fs_close(fd) == 0);
+  assert(block_read(31, buf) == 0);
+  assert(buf[0] == 'q');
+  assert(umount_fs(fs_name) == 0);
+
+  // closing one disk leaves the rest open
+  assert(disk_close(a) == 0);
+  assert(disk_read(b, 31, buf) == 0 && buf[sizeof(int)] == 'z');
+  assert(block_read(31, buf) == 0 && buf[0] == 'q');
+  assert(disk_close(b) == 0);
+  assert(close_disk() == 0);
+
+  assert(mount_fs(fs_name) == 0);
+  fd = fs_open("file");
+  assert(fs_read(fd, buf, sizeof(buf)) == 14);
+  assert(memcmp(buf, "on the fs disk", 14) == 0);
+  assert(fs_close(fd) == 0);
+  assert(umount_fs(fs_name) == 0);
+
+  for (int i = 0; i < 3; i++) {
+    assert(remove(names[i]) == 0);
+  }
+  assert(remove(fs_name) == 0);
+  printf("Disks test passed!\n");
+  return 0;
+}
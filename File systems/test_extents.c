@@ -0,0 +1,118 @@
+#include "fs.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BYTES_KB 1024
+#define BYTES_MB (1024 * BYTES_KB)
+#define CHUNK (16 * BYTES_KB)
+#define ROUNDS 64
+
+int main() {
+  const char *disk_name = "test_fs";
+  size_t len = CHUNK * ROUNDS;
+  char *write_buf[2];
+  char *read_buf = malloc(len);
+  int fds[2];
+
+  for (int f = 0; f < 2; f++) {
+    write_buf[f] = malloc(len);
+    for (size_t i = 0; i < len; i++) {
+      write_buf[f][i] = 'a' + (i + f) % 26;
+    }
+  }
+
+  remove(disk_name);
+  assert(make_fs_flags(disk_name, FS_EXTENTS) == 0);
+  assert(mount_fs(disk_name) == 0);
+
+  // two files appended in turns and synced after every round, so their pending blocks get
+  // disk blocks a chunk at a time: neither can keep growing in place, so both end up with far
+  // more extents than fit in the inode
+  assert(fs_create("a") == 0);
+  assert(fs_create("b") == 0);
+  fds[0] = fs_open("a");
+  fds[1] = fs_open("b");
+  for (int r = 0; r < ROUNDS; r++) {
+    for (int f = 0; f < 2; f++) {
+      assert(fs_write(fds[f], write_buf[f] + r * CHUNK, CHUNK) == CHUNK);
+    }
+    assert(fs_sync() == 0);
+  }
+  for (int f = 0; f < 2; f++) {
+    assert(fs_lseek(fds[f], 0) == 0);
+    assert(fs_read(fds[f], read_buf, len) == len);
+    assert(memcmp(read_buf, write_buf[f], len) == 0);
+  }
+
+  // cut "a" in the middle of an extent, then grow it again
+  assert(fs_truncate(fds[0], len / 2 + 100) == 0);
+  assert(fs_get_filesize(fds[0]) == len / 2 + 100);
+  assert(fs_lseek(fds[0], len / 2 + 100) == 0);
+  assert(fs_write(fds[0], write_buf[0] + len / 2 + 100, len / 2 - 100) == len / 2 - 100);
+  assert(fs_close(fds[1]) == 0);
+
+  // "c" is written in one go and gets the blocks "b" gives back
+  assert(fs_delete("b") == 0);
+  assert(fs_create("c") == 0);
+  fds[1] = fs_open("c");
+  assert(fs_write(fds[1], write_buf[1], len) == len);
+
+  // a fresh cache, so the data comes back from the disk
+  assert(fs_sync() == 0);
+  assert(fs_cache_size(256) == 0);
+  for (int f = 0; f < 2; f++) {
+    assert(fs_lseek(fds[f], 0) == 0);
+    assert(fs_read(fds[f], read_buf, len) == len);
+    assert(memcmp(read_buf, write_buf[f], len) == 0);
+    assert(fs_close(fds[f]) == 0);
+  }
+
+  // the overflow blocks and the inodes sharing a table block survive a remount
+  assert(umount_fs(disk_name) == 0);
+  assert(mount_fs(disk_name) == 0);
+  fds[0] = fs_open("a");
+  fds[1] = fs_open("c");
+  for (int f = 0; f < 2; f++) {
+    assert(fs_read(fds[f], read_buf, len) == len);
+    assert(memcmp(read_buf, write_buf[f], len) == 0);
+    assert(fs_close(fds[f]) == 0);
+  }
+
+  // fill the disk, then give it all back
+  assert(fs_create("big") == 0);
+  fds[0] = fs_open("big");
+  while (fs_write(fds[0], write_buf[0], len) == len) {
+  }
+  assert(fs_write(fds[0], write_buf[0], 1) == 0);
+  assert(fs_truncate(fds[0], 0) == 0);
+  assert(fs_write(fds[0], write_buf[0], len) == len);
+  assert(fs_close(fds[0]) == 0);
+  assert(fs_delete("big") == 0);
+  assert(fs_delete("a") == 0);
+  assert(fs_delete("c") == 0);
+  assert(umount_fs(disk_name) == 0);
+
+  // deleted files stay deleted
+  assert(mount_fs(disk_name) == 0);
+  assert(fs_open("a") == -1);
+  assert(fs_create("d") == 0);
+  fds[0] = fs_open("d");
+  assert(fs_write(fds[0], write_buf[0], len) == len);
+  assert(fs_close(fds[0]) == 0);
+  assert(umount_fs(disk_name) == 0);
+  assert(mount_fs(disk_name) == 0);
+  fds[0] = fs_open("d");
+  assert(fs_read(fds[0], read_buf, len) == len);
+  assert(memcmp(read_buf, write_buf[0], len) == 0);
+  assert(fs_close(fds[0]) == 0);
+  assert(umount_fs(disk_name) == 0);
+
+  assert(remove(disk_name) == 0);
+  free(write_buf[0]);
+  free(write_buf[1]);
+  free(read_buf);
+  printf("Extents test passed!\n");
+  return 0;
+}
@@ -0,0 +1,59 @@
+#include "fs.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BYTES_KB 1024
+#define SIZE (256 * BYTES_KB)
+
+int main() {
+  const char *disk_name = "test_fs";
+  char *write_buf = malloc(SIZE);
+  char *read_buf = malloc(SIZE);
+  int fd;
+
+  for (int i = 0; i < SIZE; i++) {
+    write_buf[i] = 'a' + (i % 19);
+  }
+
+  remove(disk_name);
+  assert(make_fs(disk_name) == 0);
+  assert(mount_fs(disk_name) == 0);
+  assert(fs_create("file") == 0);
+  fd = fs_open("file");
+  assert(fd >= 0);
+
+  // appends through fs_pwrite, the file pointer stays at 0
+  for (int off = 0; off < SIZE; off += 1000) {
+    int n = SIZE - off < 1000 ? SIZE - off : 1000;
+    assert(fs_pwrite(fd, write_buf + off, n, off) == n);
+  }
+  assert(fs_get_filesize(fd) == SIZE);
+  assert(fs_pwrite(fd, write_buf, 1, SIZE + 1) == -1); // past the end of the file
+  assert(fs_pwrite(fd, write_buf, 1, -1) == -1);
+
+  // overwrite in the middle, then read the regions back out of order
+  memcpy(write_buf + 5000, "positional", 10);
+  assert(fs_pwrite(fd, "positional", 10, 5000) == 10);
+  for (int off = SIZE - 4 * BYTES_KB; off >= 0; off -= 4 * BYTES_KB) {
+    assert(fs_pread(fd, read_buf + off, 4 * BYTES_KB, off) == 4 * BYTES_KB);
+  }
+  assert(memcmp(read_buf, write_buf, SIZE) == 0);
+  assert(fs_pread(fd, read_buf, 100, SIZE - 10) == 10); // short read at the end
+  assert(fs_pread(fd, read_buf, 100, SIZE) == 0);
+  assert(fs_pread(fd, read_buf, 100, -1) == -1);
+
+  // the file pointer was never moved
+  assert(fs_read(fd, read_buf, 10) == 10);
+  assert(memcmp(read_buf, write_buf, 10) == 0);
+
+  assert(fs_close(fd) == 0);
+  assert(fs_pread(fd, read_buf, 10, 0) == -1); // file not opened
+  assert(umount_fs(disk_name) == 0);
+  assert(remove(disk_name) == 0);
+  free(write_buf);
+  free(read_buf);
+  printf("Positional I/O test passed!\n");
+  return 0;
+}
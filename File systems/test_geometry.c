@@ -0,0 +1,52 @@
+#include "fs.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BYTES_KB 1024
+#define BYTES_MB (1024 * BYTES_KB)
+#define BYTES_40MB (40 * BYTES_MB)
+
+int main() {
+  const char *disk_name = "test_fs";
+  const char *file_name = "big_file";
+  char *write_buf = malloc(BYTES_40MB);
+  char *read_buf = malloc(BYTES_40MB);
+  int fd;
+
+  for (int i = 0; i < BYTES_40MB; i++) {
+    write_buf[i] = 'A' + (i % 26);
+  }
+
+  // bad geometries are refused
+  remove(disk_name);
+  assert(make_fs_geometry(disk_name, 8192, 1000) == -1); // not a power of two
+  assert(make_fs_geometry(disk_name, 2, 4096) == -1);    // no room for data
+
+  // 64 MiB disk with 16 KiB blocks: a 40 MiB file fits
+  assert(make_fs_geometry(disk_name, 4096, 16 * BYTES_KB) == 0);
+  assert(mount_fs(disk_name) == 0);
+  assert(fs_create(file_name) == 0);
+  fd = fs_open(file_name);
+  assert(fd >= 0);
+  assert(fs_write(fd, write_buf, BYTES_40MB) == BYTES_40MB);
+  assert(fs_get_filesize(fd) == BYTES_40MB);
+  assert(fs_close(fd) == 0);
+  assert(umount_fs(disk_name) == 0);
+
+  // the geometry comes back from the disk on the next mount
+  assert(mount_fs(disk_name) == 0);
+  fd = fs_open(file_name);
+  assert(fd >= 0);
+  assert(fs_read(fd, read_buf, BYTES_40MB) == BYTES_40MB);
+  assert(memcmp(read_buf, write_buf, BYTES_40MB) == 0);
+  assert(fs_close(fd) == 0);
+  assert(umount_fs(disk_name) == 0);
+
+  assert(remove(disk_name) == 0);
+  free(write_buf);
+  free(read_buf);
+  printf("Geometry test passed!\n");
+  return 0;
+}
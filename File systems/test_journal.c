@@ -0,0 +1,180 @@
+#include "disk.h"
+#include "fs.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BYTES_MB (1024 * 1024)
+#define IMAGE_SIZE (DISK_HDR_SIZE + (size_t)DISK_BLOCKS * BLOCK_SIZE)
+#define DIR_BLOCKS 10     // dir_blocks, in uint32_t words of the superblock
+#define JOURNAL_BLOCKS 12 // journal_blocks
+#define JOURNAL_OFFSET 13 // journal_offset
+#define FILES 4096        // an inode table and directory of over 80 blocks
+
+static char *image_read(const char *name) {
+  char *image = malloc(IMAGE_SIZE);
+  FILE *f = fopen(name, "rb");
+  assert(f != NULL);
+  assert(fread(image, 1, IMAGE_SIZE, f) == IMAGE_SIZE);
+  fclose(f);
+  return image;
+}
+
+static void image_write(const char *name, const char *image) {
+  FILE *f = fopen(name, "wb");
+  assert(f != NULL);
+  assert(fwrite(image, 1, IMAGE_SIZE, f) == IMAGE_SIZE);
+  fclose(f);
+}
+
+// put the tables of image back the way they are in old, as if a crash kept the last commit from
+// writing any of them in place
+static void lose_in_place(char *image, const char *old) {
+  uint32_t journal = ((uint32_t *)(image + DISK_HDR_SIZE))[JOURNAL_OFFSET];
+  assert(journal > 1 && journal < DISK_BLOCKS);
+  memcpy(image + DISK_HDR_SIZE + BLOCK_SIZE, old + DISK_HDR_SIZE + BLOCK_SIZE, (size_t)(journal - 1) * BLOCK_SIZE);
+}
+
+static void check(const char *name, const char *data, size_t len) {
+  char *buf = malloc(len);
+  int fd = fs_open(name);
+  assert(fd >= 0);
+  assert(fs_get_filesize(fd) == (int)len);
+  assert(fs_read(fd, buf, len) == (int)len);
+  assert(memcmp(buf, data, len) == 0);
+  assert(fs_close(fd) == 0);
+  free(buf);
+}
+
+int main() {
+  const char *disk_name = "test_fs";
+  size_t len = 10000;
+  char *data = malloc(len);
+  int fd;
+
+  for (size_t i = 0; i < len; i++) {
+    data[i] = 'a' + i % 26;
+  }
+
+  remove(disk_name);
+  assert(make_fs(disk_name) == 0);
+  assert(mount_fs(disk_name) == 0);
+  assert(fs_create("old") == 0);
+  fd = fs_open("old");
+  assert(fs_write(fd, data, len) == (int)len);
+  assert(fs_close(fd) == 0);
+  assert(umount_fs(disk_name) == 0);
+  char *before = image_read(disk_name);
+
+  // one more file, committed by fs_sync; the image is taken before umount_fs empties the journal
+  assert(mount_fs(disk_name) == 0);
+  assert(fs_create("new") == 0);
+  fd = fs_open("new");
+  assert(fs_write(fd, data + 1, len - 1) == (int)len - 1);
+  assert(fs_close(fd) == 0);
+  assert(fs_sync() == 0);
+  char *after = image_read(disk_name);
+  assert(umount_fs(disk_name) == 0);
+
+  // a crash right after the commit: the transaction is in the journal, but none of its blocks
+  // made it in place
+  uint32_t journal = ((uint32_t *)(after + DISK_HDR_SIZE))[JOURNAL_OFFSET];
+  lose_in_place(after, before);
+  image_write(disk_name, after);
+
+  assert(mount_fs(disk_name) == 0);
+  check("old", data, len);
+  check("new", data + 1, len - 1);
+  assert(umount_fs(disk_name) == 0);
+
+  // a crash while the transaction was being written: it doesn't count, the disk is as it was
+  after[DISK_HDR_SIZE + (size_t)(journal + 1) * BLOCK_SIZE] ^= 1;
+  image_write(disk_name, after);
+
+  assert(mount_fs(disk_name) == 0);
+  check("old", data, len);
+  assert(fs_open("new") == -1);
+  assert(umount_fs(disk_name) == 0);
+
+  // a superblock without room for the directory or the journal doesn't mount
+  uint32_t *super = (uint32_t *)(before + DISK_HDR_SIZE);
+  super[DIR_BLOCKS] = 0;
+  image_write(disk_name, before);
+  assert(mount_fs(disk_name) == -1);
+  super = (uint32_t *)(after + DISK_HDR_SIZE);
+  super[JOURNAL_BLOCKS] = 0;
+  image_write(disk_name, after);
+  assert(mount_fs(disk_name) == -1);
+  free(before);
+  free(after);
+
+  // a write_back that changes every block of a big inode table and directory is still one
+  // transaction, all of which the journal brings back
+  char name[16];
+  assert(make_fs_files(disk_name, FILES) == 0);
+  assert(mount_fs(disk_name) == 0);
+  assert(umount_fs(disk_name) == 0);
+  before = image_read(disk_name);
+  assert(mount_fs(disk_name) == 0);
+  for (int f = 0; f < FILES; f++) {
+    snprintf(name, sizeof(name), "f%d", f);
+    assert(fs_create(name) == 0);
+    fd = fs_open(name);
+    assert(fs_write(fd, name, strlen(name)) == (int)strlen(name));
+    assert(fs_close(fd) == 0);
+  }
+  assert(fs_sync() == 0);
+  after = image_read(disk_name);
+  assert(umount_fs(disk_name) == 0);
+  lose_in_place(after, before);
+  image_write(disk_name, after);
+
+  assert(mount_fs(disk_name) == 0);
+  for (int f = 0; f < FILES; f++) {
+    snprintf(name, sizeof(name), "f%d", f);
+    check(name, name, strlen(name));
+  }
+  assert(umount_fs(disk_name) == 0);
+
+  // a full disk, then a file deleted and another written in its place before the delete is
+  // committed: after a crash, the deleted file is either gone or still holds its own data
+  char *fill = calloc(1, BYTES_MB);
+  assert(make_fs(disk_name) == 0);
+  assert(mount_fs(disk_name) == 0);
+  assert(fs_create("old") == 0);
+  fd = fs_open("old");
+  assert(fs_write(fd, data, len) == (int)len);
+  assert(fs_close(fd) == 0);
+  assert(fs_create("fill") == 0);
+  fd = fs_open("fill");
+  while (fs_write(fd, fill, BYTES_MB) == BYTES_MB) {
+  }
+  assert(fs_close(fd) == 0);
+  assert(fs_sync() == 0);
+  assert(fs_delete("old") == 0);
+  assert(fs_create("new") == 0);
+  fd = fs_open("new");
+  assert(fs_write(fd, data + 1, len - 1) == (int)len - 1);
+  assert(fs_close(fd) == 0);
+  assert(fs_cache_size(1024) == 0); // a new cache, the old one writes its data back
+  char *crash = image_read(disk_name);
+  assert(umount_fs(disk_name) == 0);
+  image_write(disk_name, crash);
+
+  assert(mount_fs(disk_name) == 0);
+  if (fs_open("old") != -1) {
+    check("old", data, len);
+  }
+  assert(umount_fs(disk_name) == 0);
+  free(crash);
+  free(fill);
+
+  assert(remove(disk_name) == 0);
+  free(before);
+  free(after);
+  free(data);
+  printf("Journal test passed!\n");
+  return 0;
+}
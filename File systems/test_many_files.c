@@ -0,0 +1,104 @@
+#include "fs.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FILES 300 // past 256, so inode numbers don't fit a byte
+#define CHUNK (10 * 1024)
+#define ROUNDS 4
+
+static char byte_at(int file, size_t i) { return 'a' + (i * 3 + file) % 26; }
+
+// bytes file gets per round
+static size_t chunk_of(int file) { return file % 8 == 0 ? CHUNK : 100; }
+
+static void check(int fd, int file, size_t len) {
+  char *buf = malloc(len + 1);
+  assert(fs_lseek(fd, 0) == 0);
+  assert(fs_get_filesize(fd) == (int)len);
+  assert(fs_read(fd, buf, len + 1) == (int)len);
+  for (size_t i = 0; i < len; i++) {
+    assert(buf[i] == byte_at(file, i));
+  }
+  free(buf);
+}
+
+int main() {
+  const char *disk_name = "test_fs";
+  char name[16];
+  int fds[FILES];
+  char *buf = malloc(CHUNK * ROUNDS);
+
+  remove(disk_name);
+  assert(make_fs_files(disk_name, FILES) == 0);
+  assert(mount_fs(disk_name) == 0);
+  for (int f = 0; f < FILES; f++) {
+    snprintf(name, sizeof(name), "f%d", f);
+    assert(fs_create(name) == 0);
+  }
+  assert(fs_create("one too many") == -1);
+
+  // 32 descriptors by default
+  for (int f = 0; f < 32; f++) {
+    snprintf(name, sizeof(name), "f%d", f);
+    assert((fds[f] = fs_open(name)) >= 0);
+  }
+  assert(fs_open("f32") == -1);
+  assert(fs_fd_limit(16) == -1); // descriptors past 16 are open
+  for (int f = 0; f < 32; f++) {
+    assert(fs_close(fds[f]) == 0);
+  }
+
+  // a descriptor for every file, written in turns so that the writes to files 256 inodes
+  // apart interleave
+  assert(fs_fd_limit(FILES) == 0);
+  for (int f = 0; f < FILES; f++) {
+    snprintf(name, sizeof(name), "f%d", f);
+    assert((fds[f] = fs_open(name)) >= 0);
+  }
+  for (int r = 0; r < ROUNDS; r++) {
+    for (int f = 0; f < FILES; f++) {
+      size_t len = chunk_of(f);
+      for (size_t i = 0; i < len; i++) {
+        buf[i] = byte_at(f, r * len + i);
+      }
+      assert(fs_write(fds[f], buf, len) == (int)len);
+    }
+  }
+  for (int f = 0; f < FILES; f++) {
+    check(fds[f], f, ROUNDS * chunk_of(f));
+  }
+
+  // deleting one file leaves the one 256 inodes away alone
+  assert(fs_close(fds[8]) == 0);
+  snprintf(name, sizeof(name), "f%d", 8);
+  assert(fs_delete(name) == 0);
+  check(fds[264], 264, ROUNDS * chunk_of(264));
+  for (int f = 0; f < FILES; f++) {
+    if (f != 8) {
+      assert(fs_close(fds[f]) == 0);
+    }
+  }
+  assert(umount_fs(disk_name) == 0);
+
+  // all of it survives a remount
+  assert(mount_fs(disk_name) == 0);
+  assert(fs_open("f8") == -1);
+  for (int f = 0; f < FILES; f++) {
+    if (f != 8) {
+      snprintf(name, sizeof(name), "f%d", f);
+      int fd = fs_open(name);
+      assert(fd >= 0);
+      check(fd, f, ROUNDS * chunk_of(f));
+      assert(fs_close(fd) == 0);
+    }
+  }
+  assert(umount_fs(disk_name) == 0);
+
+  assert(fs_fd_limit(32) == 0);
+  assert(remove(disk_name) == 0);
+  free(buf);
+  printf("Many files test passed!\n");
+  return 0;
+}
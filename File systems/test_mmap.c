@@ -0,0 +1,69 @@
+#include "disk.h"
+#include "fs.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BYTES_KB 1024
+#define BYTES_MB (1024 * BYTES_KB)
+#define SIZE (3 * BYTES_MB + 123)
+
+static void check(const char *name, const char *data, size_t len) {
+  char *buf = malloc(len);
+  int fd = fs_open(name);
+  assert(fd >= 0);
+  assert(fs_get_filesize(fd) == (int)len);
+  assert(fs_read(fd, buf, len) == (int)len);
+  assert(memcmp(buf, data, len) == 0);
+  assert(fs_close(fd) == 0);
+  free(buf);
+}
+
+int main() {
+  const char *disk_name = "test_fs";
+  char *data = malloc(SIZE);
+  int fd;
+
+  for (int i = 0; i < SIZE; i++) {
+    data[i] = 'a' + (i * 3) % 26;
+  }
+
+  remove(disk_name);
+  assert(make_fs(disk_name) == 0);
+
+  // written through the mapping
+  assert(mount_fs_flags(disk_name, DISK_MMAP) == 0);
+  assert(fs_create("mapped") == 0);
+  fd = fs_open("mapped");
+  assert(fd >= 0);
+  assert(fs_write(fd, data, SIZE) == SIZE);
+  assert(fs_lseek(fd, BYTES_MB) == 0);
+  assert(fs_write(fd, "overwritten", 11) == 11);
+  memcpy(data + BYTES_MB, "overwritten", 11);
+  assert(fs_close(fd) == 0);
+  assert(umount_fs(disk_name) == 0);
+
+  // the data is in the image after a remount, mapped or not
+  assert(mount_fs_flags(disk_name, DISK_MMAP) == 0);
+  check("mapped", data, SIZE);
+  assert(umount_fs(disk_name) == 0);
+  assert(mount_fs(disk_name) == 0);
+  check("mapped", data, SIZE);
+
+  // and what the page-cache backend writes shows through the mapping
+  assert(fs_create("plain") == 0);
+  fd = fs_open("plain");
+  assert(fs_write(fd, data + 1, SIZE - 1) == SIZE - 1);
+  assert(fs_close(fd) == 0);
+  assert(umount_fs(disk_name) == 0);
+  assert(mount_fs_flags(disk_name, DISK_MMAP) == 0);
+  check("plain", data + 1, SIZE - 1);
+  check("mapped", data, SIZE);
+  assert(umount_fs(disk_name) == 0);
+
+  assert(remove(disk_name) == 0);
+  free(data);
+  printf("Mmap test passed!\n");
+  return 0;
+}
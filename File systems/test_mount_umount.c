@@ -18,6 +18,10 @@ int main() {
 
     // Mount and then unmount the newly created filesystem, both should succeed
     assert(mount_fs(disk_name) == 0);
+
+    // While mounted, neither a second mount nor a new file system may take the disk over
+    assert(mount_fs(disk_name) == -1);
+    assert(make_fs(disk_name) == -1);
     assert(umount_fs(disk_name) == 0);
 
     // Open the filesystem disk file to inspect its content
@@ -0,0 +1,134 @@
+#include "disk.h"
+#include "fs.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BLOCKS 256 // the file, in blocks
+#define CHUNK (4 * BLOCK_SIZE)
+#define SLACK 4 // blocks of metadata a read may load besides the file's own
+
+extern struct disk *dsk; // the disk of the mounted file system, from fs.c
+
+static unsigned long read_blocks(void) {
+  struct disk_stats st;
+  disk_stats(dsk, &st);
+  return st.read_bytes / BLOCK_SIZE;
+}
+
+// read the whole of name in CHUNK reads, which read ahead, and check it against data
+static void check(const char *name, const char *data, size_t len) {
+  char *buf = malloc(CHUNK);
+  int fd = fs_open(name);
+  assert(fd >= 0);
+  assert(fs_get_filesize(fd) == (int)len);
+  for (size_t off = 0; off < len; off += CHUNK) {
+    assert(fs_read(fd, buf, CHUNK) == CHUNK);
+    assert(memcmp(buf, data + off, CHUNK) == 0);
+  }
+  assert(fs_close(fd) == 0);
+  free(buf);
+}
+
+// wait for the read-ahead of a scan of the first half to get past it and settle, finished
+// but not yet looked at by the cache
+static void wait_ahead(void) {
+  unsigned long last = 0;
+  for (int i = 0; i < 5000 && (read_blocks() <= BLOCKS / 2 + SLACK || read_blocks() != last); i++) {
+    last = read_blocks();
+    usleep(20000);
+  }
+  assert(read_blocks() > BLOCKS / 2 + SLACK);
+}
+
+// read the first half of file in CHUNK reads, checking it against data
+static void scan_half(const char *data) {
+  char *buf = malloc(CHUNK);
+  int fd = fs_open("file");
+  assert(fd >= 0);
+  disk_stats_reset(dsk);
+  for (size_t off = 0; off < BLOCKS / 2 * BLOCK_SIZE; off += CHUNK) {
+    assert(fs_read(fd, buf, CHUNK) == CHUNK);
+    assert(memcmp(buf, data + off, CHUNK) == 0);
+  }
+  assert(fs_close(fd) == 0);
+  free(buf);
+}
+
+int main() {
+  const char *disk_name = "test_fs";
+  size_t len = (size_t)BLOCKS * BLOCK_SIZE;
+  char *data = malloc(len);
+  char *buf = malloc(len);
+
+  for (size_t i = 0; i < len; i++) {
+    data[i] = 'a' + (i * 7 + i / BLOCK_SIZE) % 26;
+  }
+
+  remove(disk_name);
+  assert(make_fs(disk_name) == 0);
+  assert(mount_fs(disk_name) == 0);
+  assert(fs_create("file") == 0);
+  int fd = fs_open("file");
+  assert(fs_write(fd, data, len) == (int)len);
+  assert(fs_close(fd) == 0);
+  assert(umount_fs(disk_name) == 0);
+
+  // through the page cache a scan reads what it asks for and nothing past it
+  assert(mount_fs(disk_name) == 0);
+  scan_half(data);
+  assert(read_blocks() >= BLOCKS / 2 && read_blocks() <= BLOCKS / 2 + SLACK);
+  assert(umount_fs(disk_name) == 0);
+
+  // without it the scan runs ahead of the reads, in the background
+  assert(mount_fs_flags(disk_name, DISK_DIRECT) == 0);
+  scan_half(data);
+  wait_ahead();
+
+  // and what it read ahead is what the file holds
+  check("file", data, len);
+  assert(umount_fs(disk_name) == 0);
+
+  // a block that was read ahead and then written keeps what was written
+  assert(mount_fs_flags(disk_name, DISK_DIRECT) == 0);
+  scan_half(data);
+  wait_ahead();
+  fd = fs_open("file");
+  memset(data + len / 2, 'w', len / 2);
+  assert(fs_pwrite(fd, data + len / 2, len / 2, len / 2) == (int)len / 2);
+  assert(fs_close(fd) == 0);
+  assert(umount_fs(disk_name) == 0);
+  assert(mount_fs(disk_name) == 0);
+  check("file", data, len);
+  assert(umount_fs(disk_name) == 0);
+
+  // blocks read ahead, freed and given to another file read back as that file's
+  assert(mount_fs_flags(disk_name, DISK_DIRECT) == 0);
+  scan_half(data);
+  wait_ahead();
+  fd = fs_open("file");
+  assert(fs_truncate(fd, 0) == 0);
+  assert(fs_close(fd) == 0);
+  assert(fs_sync() == 0); // the freed blocks can be handed out again
+  for (size_t i = 0; i < len; i++) {
+    buf[i] = 'A' + (i * 5 + i / BLOCK_SIZE) % 26;
+  }
+  assert(fs_create("other") == 0);
+  fd = fs_open("other");
+  assert(fs_write(fd, buf, len) == (int)len);
+  assert(fs_close(fd) == 0);
+  check("other", buf, len);
+  check("other", buf, len);
+  assert(umount_fs(disk_name) == 0);
+  assert(mount_fs(disk_name) == 0);
+  check("other", buf, len);
+  assert(umount_fs(disk_name) == 0);
+
+  assert(remove(disk_name) == 0);
+  free(data);
+  free(buf);
+  printf("Read-ahead test passed!\n");
+  return 0;
+}
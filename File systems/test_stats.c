@@ -0,0 +1,82 @@
+#include "disk.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static unsigned long total(const unsigned long *lat) {
+  unsigned long n = 0;
+  for (int i = 0; i < DISK_STATS_BUCKETS; i++) {
+    n += lat[i];
+  }
+  return n;
+}
+
+int main() {
+  const char *disk_name = "test_disk";
+  char *buf = calloc(4, BLOCK_SIZE);
+  void *bufs[4] = {buf, buf + BLOCK_SIZE, buf + 2 * BLOCK_SIZE, buf + 3 * BLOCK_SIZE};
+  struct disk_stats st;
+
+  remove(disk_name);
+  assert(make_disk(disk_name) == 0);
+  assert(open_disk(disk_name) == 0);
+  disk_stats(NULL, &st);
+  assert(st.reads == 0 && st.writes == 0 && st.sequential == 0 && st.random == 0);
+
+  // ten writes in a row: the first is random, the rest follow on
+  for (int i = 0; i < 10; i++) {
+    assert(block_write(i, buf) == 0);
+  }
+  disk_stats(NULL, &st);
+  assert(st.writes == 10 && st.write_bytes == 10UL * BLOCK_SIZE);
+  assert(st.reads == 0 && st.read_bytes == 0);
+  assert(st.random == 1 && st.sequential == 9);
+
+  // a jump, then the block after it
+  assert(block_read(100, buf) == 0);
+  assert(block_read(101, buf) == 0);
+  disk_stats(NULL, &st);
+  assert(st.reads == 2 && st.read_bytes == 2UL * BLOCK_SIZE);
+  assert(st.random == 2 && st.sequential == 10);
+
+  // a vectored call is a request per run of adjacent blocks
+  int wblocks[4] = {200, 201, 202, 50};
+  assert(block_writev(4, wblocks, (const void *const *)bufs) == 0);
+  int rblocks[2] = {51, 52};
+  assert(block_readv(2, rblocks, bufs) == 0);
+  disk_stats(NULL, &st);
+  assert(st.writes == 12 && st.write_bytes == 14UL * BLOCK_SIZE);
+  assert(st.reads == 3 && st.read_bytes == 4UL * BLOCK_SIZE);
+  assert(st.random == 4 && st.sequential == 11);
+
+  // every request lands in one latency bucket
+  assert(total(st.write_lat) == st.writes);
+  assert(total(st.read_lat) == st.reads);
+
+  // a reset forgets the counters and where the last request ended
+  disk_stats_reset(NULL);
+  disk_stats(NULL, &st);
+  assert(st.reads == 0 && st.writes == 0 && st.sequential == 0 && st.random == 0);
+  assert(total(st.write_lat) == 0 && total(st.read_lat) == 0);
+  assert(block_read(53, buf) == 0);
+  disk_stats(NULL, &st);
+  assert(st.reads == 1 && st.random == 1 && st.sequential == 0);
+
+  // a disk of its own counts on its own
+  struct disk *d = disk_open(disk_name, DISK_STATS);
+  assert(d != NULL);
+  assert(disk_write(d, 7, buf) == 0);
+  assert(disk_write(d, 8, buf) == 0);
+  disk_stats(d, &st);
+  assert(st.writes == 2 && st.reads == 0 && st.random == 1 && st.sequential == 1);
+  disk_stats(NULL, &st);
+  assert(st.writes == 0 && st.reads == 1);
+  assert(disk_close(d) == 0); // DISK_STATS dumps the counters here
+
+  assert(close_disk() == 0);
+  assert(remove(disk_name) == 0);
+  free(buf);
+  printf("Stats test passed!\n");
+  return 0;
+}
@@ -0,0 +1,170 @@
+#include "fs.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BYTES_KB 1024
+#define BYTES_MB (1024 * BYTES_KB)
+#define SHARED 4
+#define READERS 4
+#define WRITERS 4
+#define CHUNK 1000
+
+static char *data;
+static int shared_fds[SHARED];
+
+static char byte_at(int file, size_t i) { return 'a' + (i * 7 + file) % 26; }
+
+// readers: random regions of every shared file through the one descriptor each file has,
+// plus a whole pass through a descriptor of their own
+static void *reader(void *arg) {
+  unsigned seed = (unsigned)(size_t)arg;
+  char *buf = malloc(64 * BYTES_KB);
+
+  for (int round = 0; round < 200; round++) {
+    int f = rand_r(&seed) % SHARED;
+    size_t len = 1 + rand_r(&seed) % (64 * BYTES_KB);
+    size_t off = rand_r(&seed) % (BYTES_MB - len);
+    assert(fs_pread(shared_fds[f], buf, len, off) == (int)len);
+    for (size_t i = 0; i < len; i++) {
+      assert(buf[i] == byte_at(f, off + i));
+    }
+  }
+
+  char name[16];
+  snprintf(name, sizeof(name), "shared%d", (int)(size_t)arg % SHARED);
+  int fd = fs_open(name);
+  assert(fd >= 0);
+  size_t off = 0;
+  int n;
+  while ((n = fs_read(fd, buf, 64 * BYTES_KB)) > 0) {
+    for (int i = 0; i < n; i++) {
+      assert(buf[i] == byte_at((int)(size_t)arg % SHARED, off + i));
+    }
+    off += n;
+  }
+  assert(off == BYTES_MB);
+  assert(fs_close(fd) == 0);
+
+  free(buf);
+  return NULL;
+}
+
+// writers: a file each, appended in small pieces, cut in half and grown back
+static void *writer(void *arg) {
+  int w = (int)(size_t)arg;
+  char name[16];
+  snprintf(name, sizeof(name), "own%d", w);
+  assert(fs_create(name) == 0);
+  int fd = fs_open(name);
+  assert(fd >= 0);
+
+  for (size_t off = 0; off < BYTES_MB; off += CHUNK) {
+    size_t n = BYTES_MB - off < CHUNK ? BYTES_MB - off : CHUNK;
+    assert(fs_write(fd, data + off, n) == (int)n);
+  }
+  assert(fs_truncate(fd, BYTES_MB / 2) == 0);
+  assert(fs_pwrite(fd, data + BYTES_MB / 2, BYTES_MB / 2, BYTES_MB / 2) == BYTES_MB / 2);
+  assert(fs_get_filesize(fd) == BYTES_MB);
+  assert(fs_close(fd) == 0);
+  return NULL;
+}
+
+// the directory changing under everyone else
+static void *churn(void *arg) {
+  (void)arg;
+  char **files;
+  for (int round = 0; round < 50; round++) {
+    assert(fs_create("scratch") == 0);
+    int fd = fs_open("scratch");
+    assert(fd >= 0);
+    assert(fs_write(fd, data, 5000) == 5000);
+    assert(fs_close(fd) == 0);
+    assert(fs_listfiles(&files) == 0);
+    for (int i = 0; files[i] != NULL; i++) {
+      free(files[i]);
+    }
+    free(files);
+    assert(fs_delete("scratch") == 0);
+    if (round % 10 == 0) {
+      assert(fs_sync() == 0);
+    }
+  }
+  return NULL;
+}
+
+static void check(const char *name, int file) {
+  char *buf = malloc(BYTES_MB);
+  int fd = fs_open(name);
+  assert(fd >= 0);
+  assert(fs_read(fd, buf, BYTES_MB) == BYTES_MB);
+  for (size_t i = 0; i < BYTES_MB; i++) {
+    assert(buf[i] == (file < 0 ? data[i] : byte_at(file, i)));
+  }
+  assert(fs_close(fd) == 0);
+  free(buf);
+}
+
+int main() {
+  const char *disk_name = "test_fs";
+  pthread_t threads[READERS + WRITERS + 1];
+  char name[16];
+
+  data = malloc(BYTES_MB);
+  for (size_t i = 0; i < BYTES_MB; i++) {
+    data[i] = 'A' + i % 23;
+  }
+
+  remove(disk_name);
+  assert(make_fs(disk_name) == 0);
+  assert(fs_cache_size(128) == 0); // small, so the threads evict each other's blocks
+  assert(mount_fs(disk_name) == 0);
+
+  char *buf = malloc(BYTES_MB);
+  for (int f = 0; f < SHARED; f++) {
+    snprintf(name, sizeof(name), "shared%d", f);
+    assert(fs_create(name) == 0);
+    shared_fds[f] = fs_open(name);
+    for (size_t i = 0; i < BYTES_MB; i++) {
+      buf[i] = byte_at(f, i);
+    }
+    assert(fs_write(shared_fds[f], buf, BYTES_MB) == BYTES_MB);
+  }
+  free(buf);
+
+  for (int t = 0; t < READERS; t++) {
+    assert(pthread_create(&threads[t], NULL, reader, (void *)(size_t)t) == 0);
+  }
+  for (int t = 0; t < WRITERS; t++) {
+    assert(pthread_create(&threads[READERS + t], NULL, writer, (void *)(size_t)t) == 0);
+  }
+  assert(pthread_create(&threads[READERS + WRITERS], NULL, churn, NULL) == 0);
+  for (int t = 0; t < READERS + WRITERS + 1; t++) {
+    assert(pthread_join(threads[t], NULL) == 0);
+  }
+
+  for (int f = 0; f < SHARED; f++) {
+    assert(fs_close(shared_fds[f]) == 0);
+  }
+  assert(umount_fs(disk_name) == 0);
+
+  // all of it made it to the disk
+  assert(mount_fs(disk_name) == 0);
+  assert(fs_open("scratch") == -1);
+  for (int f = 0; f < SHARED; f++) {
+    snprintf(name, sizeof(name), "shared%d", f);
+    check(name, f);
+  }
+  for (int w = 0; w < WRITERS; w++) {
+    snprintf(name, sizeof(name), "own%d", w);
+    check(name, -1);
+  }
+  assert(umount_fs(disk_name) == 0);
+
+  assert(remove(disk_name) == 0);
+  free(data);
+  printf("Threads test passed!\n");
+  return 0;
+}
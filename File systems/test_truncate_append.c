@@ -0,0 +1,68 @@
+#include "fs.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOCK 4096
+#define BLOCKS 1200 // into the double indirect blocks of a block-mapped file
+#define APPEND 64
+
+static void fill(char *buf, size_t blocks, char c) { memset(buf, c, blocks * BLOCK); }
+
+static void check(int fd, size_t at, size_t blocks, char c) {
+  char *buf = malloc(blocks * BLOCK);
+  assert(fs_pread(fd, buf, blocks * BLOCK, at * BLOCK) == (int)(blocks * BLOCK));
+  for (size_t i = 0; i < blocks * BLOCK; i++) {
+    assert(buf[i] == c);
+  }
+  free(buf);
+}
+
+// write, commit, overwrite, cut the file to keep blocks and append: the appended blocks read
+// back as written, also after a remount
+static void truncate_append(const char *disk_name, int flags, size_t keep) {
+  char *buf = malloc(BLOCKS * BLOCK);
+
+  assert(make_fs_flags(disk_name, flags) == 0);
+  assert(mount_fs(disk_name) == 0);
+  assert(fs_create("file") == 0);
+  int fd = fs_open("file");
+  fill(buf, BLOCKS, 'A');
+  assert(fs_write(fd, buf, BLOCKS * BLOCK) == BLOCKS * BLOCK);
+  assert(fs_sync() == 0);
+  fill(buf, BLOCKS, 'C');
+  assert(fs_pwrite(fd, buf, BLOCKS * BLOCK, 0) == BLOCKS * BLOCK);
+  assert(fs_truncate(fd, keep * BLOCK) == 0);
+  assert(fs_lseek(fd, keep * BLOCK) == 0);
+  fill(buf, APPEND, 'B');
+  assert(fs_write(fd, buf, APPEND * BLOCK) == APPEND * BLOCK);
+  assert(fs_get_filesize(fd) == (int)((keep + APPEND) * BLOCK));
+  check(fd, 0, keep, 'C');
+  check(fd, keep, APPEND, 'B');
+  assert(fs_close(fd) == 0);
+  assert(umount_fs(disk_name) == 0);
+
+  assert(mount_fs(disk_name) == 0);
+  fd = fs_open("file");
+  check(fd, 0, keep, 'C');
+  check(fd, keep, APPEND, 'B');
+  assert(fs_close(fd) == 0);
+  assert(umount_fs(disk_name) == 0);
+  free(buf);
+}
+
+int main() {
+  const char *disk_name = "test_fs";
+  // within the direct blocks, the single indirect block and the double indirect one
+  size_t keeps[] = {5, 32, 1040, 1100};
+
+  remove(disk_name);
+  for (size_t i = 0; i < sizeof(keeps) / sizeof(keeps[0]); i++) {
+    truncate_append(disk_name, 0, keeps[i]);
+    truncate_append(disk_name, FS_EXTENTS, keeps[i]);
+  }
+  assert(remove(disk_name) == 0);
+  printf("Truncate and append test passed!\n");
+  return 0;
+}
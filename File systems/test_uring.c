@@ -0,0 +1,121 @@
+#include "disk.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define REQS 100 // more than one ring's worth, so a block_prep has to flush a full batch
+#define RUN_MAX 3
+
+static int completed;
+static int failed;
+
+static void done(void *arg, int status) {
+  completed++;
+  if (status != 0) {
+    failed++;
+  }
+  *(int *)arg = status;
+}
+
+static char *aligned(size_t blocks) {
+  void *p;
+  assert(posix_memalign(&p, DISK_ALIGN, blocks * BLOCK_SIZE) == 0);
+  return p;
+}
+
+// REQS runs of 1 to RUN_MAX blocks written with block_prep/block_flush on d, then read back
+// the same way into back, a block apart, with every other read unaligned when misalign is set
+static void batch(struct disk *d, const char *data, char *back, size_t misalign) {
+  int status[REQS];
+  int base = completed;
+
+  for (int r = 0; r < REQS; r++) {
+    status[r] = 1;
+    assert(disk_prep(d, 1, r * RUN_MAX, 1 + r % RUN_MAX, (char *)data + (size_t)r * RUN_MAX * BLOCK_SIZE,
+                     done, &status[r]) == 0);
+  }
+  assert(disk_flush(d) == 0);
+  assert(completed == base + REQS && failed == 0);
+
+  for (int r = 0; r < REQS; r++) {
+    char *buf = back + (size_t)r * (RUN_MAX + 1) * BLOCK_SIZE + (r % 2 ? misalign : 0);
+    assert(disk_prep(d, 0, r * RUN_MAX, 1 + r % RUN_MAX, buf, done, &status[r]) == 0);
+  }
+  assert(disk_flush(d) == 0);
+  assert(completed == base + 2 * REQS && failed == 0);
+
+  for (int r = 0; r < REQS; r++) {
+    char *buf = back + (size_t)r * (RUN_MAX + 1) * BLOCK_SIZE + (r % 2 ? misalign : 0);
+    assert(status[r] == 0);
+    assert(memcmp(buf, data + (size_t)r * RUN_MAX * BLOCK_SIZE, (size_t)(1 + r % RUN_MAX) * BLOCK_SIZE) == 0);
+  }
+}
+
+int main() {
+  const char *disk_name = "test_disk";
+  size_t len = (size_t)REQS * RUN_MAX;
+  char *data = aligned(len);
+  char *back = aligned((size_t)REQS * (RUN_MAX + 1));
+  struct disk_stats st;
+  int status;
+
+  for (size_t i = 0; i < len * BLOCK_SIZE; i++) {
+    data[i] = 'a' + (i * 11 + i / BLOCK_SIZE) % 26;
+  }
+
+  remove(disk_name);
+  assert(make_disk(disk_name) == 0);
+  assert(disk_open(disk_name, DISK_URING | DISK_MMAP) == NULL);
+
+  // through the ring, or through positional I/O on kernels without one
+  struct disk *d = disk_open(disk_name, DISK_URING);
+  assert(d != NULL);
+  batch(d, data, back, 0);
+
+  // the vectored calls go through the ring too
+  int blocks[4] = {len, len + 1, len + 10, len + 3};
+  const void *wbufs[4] = {data, data + BLOCK_SIZE, data + 2 * BLOCK_SIZE, data + 3 * BLOCK_SIZE};
+  void *rbufs[4] = {back, back + BLOCK_SIZE, back + 2 * BLOCK_SIZE, back + 3 * BLOCK_SIZE};
+  assert(disk_writev(d, 4, blocks, wbufs) == 0);
+  memset(back, 0, 4 * BLOCK_SIZE);
+  assert(disk_readv(d, 4, blocks, rbufs) == 0);
+  assert(memcmp(back, data, 4 * BLOCK_SIZE) == 0);
+
+  // a request the kernel fails reaches its callback and one flush, and still counts its blocks
+  disk_stats_reset(d);
+  assert(disk_prep(d, 0, 0, RUN_MAX, (void *)(uintptr_t)BLOCK_SIZE, done, &status) == 0);
+  assert(disk_flush(d) == -1);
+  assert(status == -1);
+  assert(disk_flush(d) == 0);
+  disk_stats(d, &st);
+  assert(st.reads == 1 && st.read_bytes == (unsigned long)RUN_MAX * BLOCK_SIZE);
+  failed = 0;
+
+  // bad requests are refused up front
+  assert(disk_prep(d, 0, DISK_BLOCKS - 1, 2, back, done, &status) == -1);
+  assert(disk_prep(d, 0, -1, 1, back, done, &status) == -1);
+  assert(disk_close(d) == 0);
+
+  // O_DIRECT: aligned requests go through the ring, unaligned ones bounce beside it
+  d = disk_open(disk_name, DISK_URING | DISK_DIRECT);
+  assert(d != NULL);
+  batch(d, data, back, 1);
+  assert(disk_close(d) == 0);
+
+  // no ring at all: the same calls on the default disk, with positional I/O
+  assert(open_disk(disk_name) == 0);
+  memset(back, 0, (size_t)REQS * (RUN_MAX + 1) * BLOCK_SIZE);
+  batch(NULL, data, back, 0);
+  assert(block_prep(1, 0, 1, data, NULL, NULL) == 0);
+  assert(block_flush() == 0);
+  assert(block_flush() == 0); // nothing staged
+  assert(close_disk() == 0);
+
+  assert(remove(disk_name) == 0);
+  free(data);
+  free(back);
+  printf("Uring test passed!\n");
+  return 0;
+}